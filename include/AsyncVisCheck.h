@@ -0,0 +1,85 @@
+#pragma once
+#include "VisCheck.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+// Asynchronous front end for VisCheck. Queries are queued to a pool of worker
+// threads and answered through futures or callbacks. New geometry is built
+// on a separate loader thread and published by atomically swapping the
+// current scene pointer, so queries keep running against the old scene for
+// the whole rebuild. Each query holds a reference to the scene it started
+// with; a replaced scene is released on the loader thread once no query
+// uses it any more.
+class AsyncVisCheck {
+public:
+    // threadCount 0 picks the hardware concurrency
+    explicit AsyncVisCheck(unsigned threadCount = 0, const VisSceneOptions& options = VisSceneOptions());
+    AsyncVisCheck(const AsyncVisCheck&) = delete;
+    AsyncVisCheck& operator=(const AsyncVisCheck&) = delete;
+    // Finishes all queued loads and queries
+    ~AsyncVisCheck();
+
+    // Build and publish new geometry in the background. The future is false
+    // if loading failed or a load submitted later was published first.
+    std::future<bool> LoadGeometryAsync(std::vector<std::vector<TriangleCombined>> meshes,
+        std::vector<std::vector<HullCombined>> hullSets = std::vector<std::vector<HullCombined>>());
+    std::future<bool> LoadFromOptFileAsync(const std::string& filePath);
+    std::future<bool> LoadBVHFromFileAsync(const std::string& cachePath);
+
+    // Publish an already built scene immediately
+    void SetScene(std::shared_ptr<const VisScene> sharedScene);
+    std::shared_ptr<const VisScene> GetScene() const;
+    // Incremented on every publish
+    uint64_t GetSceneVersion() const;
+
+    std::future<bool> SubmitIsVisible(const Vec3& point1, const Vec3& point2);
+    // The callback runs on a worker thread
+    void SubmitIsVisible(const Vec3& point1, const Vec3& point2, std::function<void(bool)> callback);
+    std::future<std::vector<uint8_t>> SubmitIsVisibleBatch(std::vector<QuerySegment> segments);
+
+    size_t GetWorkerCount() const { return workers.size(); }
+    size_t GetPendingQueryCount() const;
+    // Replaced scenes still referenced by running queries
+    size_t GetRetiredSceneCount() const;
+
+private:
+    typedef std::function<void(VisCheck&)> QueryTask;
+
+    void Enqueue(QueryTask task);
+    void EnqueueLoad(std::function<void()> task);
+    void WorkerLoop();
+    void LoaderLoop();
+    bool Publish(std::shared_ptr<const VisScene> next, uint64_t ticket);
+    void ReclaimRetired();
+
+    const VisSceneOptions options;
+
+    // Read with std::atomic_load and replaced with std::atomic_exchange
+    std::shared_ptr<const VisScene> current;
+
+    mutable std::mutex publishMutex;
+    uint64_t nextTicket;
+    uint64_t publishedTicket;
+    uint64_t sceneVersion;
+    std::vector<std::shared_ptr<const VisScene>> retired;
+
+    mutable std::mutex queueMutex;
+    std::condition_variable queueWake;
+    std::deque<QueryTask> queries;
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    std::mutex loaderMutex;
+    std::condition_variable loaderWake;
+    std::deque<std::function<void()>> loads;
+    bool stoppingLoader;
+    std::thread loader;
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include "Types.h"
+#include "VisScene.h"
+#include "OccupancyGrid.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// Conservative occluder loaded from a file written by
+// OptimizedGeometry::CreateOccluderFile. Its boxes lie inside solid
+// geometry, so a segment they block is blocked for real, provided the
+// segment starts and ends outside that geometry. The file also carries the
+// occupancy grid the boxes came from; a segment with an endpoint in a cell
+// that is not empty is never reported blocked and falls through to the
+// full scene.
+class Occluder {
+public:
+    Occluder(const Occluder&) = delete;
+    Occluder& operator=(const Occluder&) = delete;
+
+    static std::shared_ptr<const Occluder> Load(const std::string& path);
+    // Store the grid the occluder was built from at the end of its file
+    static bool AppendGrid(const std::string& path, const OccupancyGrid& grid);
+
+    bool Blocks(const Vec3& point1, const Vec3& point2) const;
+    // Bit k is set if the segment from origin to targets[k] is blocked in the
+    // sense of Blocks
+    uint32_t TracePacket(const Vec3& origin, const Vec3* targets, size_t count) const;
+
+    size_t GetTriangleCount() const { return scene->GetTriangleCount(); }
+
+private:
+    Occluder() = default;
+
+    // True if p lies in an empty grid cell, which no geometry touches and
+    // which is not inside a closed part
+    bool InEmptyCell(const Vec3& p) const;
+
+    std::shared_ptr<const VisScene> scene;
+    std::vector<unsigned char> gridData;
+    OccupancyGrid grid;
+};
@@ -0,0 +1,86 @@
+#pragma once
+#include "Types.h"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Forward declarations
+struct AABB;
+struct TriangleCombined;
+struct HullCombined;
+
+// Two-level voxel occupancy grid used as a pre-pass in front of the BVH.
+// Fine cells are classified as empty (no triangle or hull touches them), solid
+// (inside a part of a mesh proven closed by its edge connectivity, or inside a
+// convex hull) or mixed. Open geometry only ever produces mixed cells. Fine
+// cells are grouped into bricks of BRICK_SIZE^3 so long empty or solid
+// stretches are skipped with a single coarse step.
+class OccupancyGrid {
+public:
+    enum class CellState : uint8_t {
+        Empty = 0,
+        Solid = 1,
+        Mixed = 2
+    };
+
+    enum class Verdict {
+        Visible,    // Segment only crosses empty cells
+        Blocked,    // Segment crosses a solid cell
+        Unknown     // Segment touches mixed cells, fall back to the BVH
+    };
+
+    static constexpr int BRICK_SIZE = 4;
+    static constexpr int MAX_CELLS_PER_AXIS = 256;
+
+    OccupancyGrid();
+    OccupancyGrid(const OccupancyGrid&) = delete;
+    OccupancyGrid& operator=(const OccupancyGrid&) = delete;
+
+    // Build the grid from meshes and hulls. cellSize is a hint in world units
+    // and is enlarged when the map would exceed MAX_CELLS_PER_AXIS.
+    bool Build(const std::vector<std::vector<TriangleCombined>>& meshes,
+        const std::vector<HullCombined>& hulls, float cellSize);
+
+    // Classify the segment from -> to. Solid answers assume both endpoints are
+    // outside solid geometry; segments starting or ending in a solid cell are
+    // always reported as Unknown.
+    Verdict Classify(const Vec3& from, const Vec3& to) const;
+    // State of the cell holding p; everything outside the grid is empty
+    CellState StateAt(const Vec3& p) const;
+
+    // Flat serialized form, embedded in VisScene blobs. Attach references the
+    // given memory without copying it, so it must outlive the grid.
+    size_t SerializedSize() const;
+    void Serialize(unsigned char* out) const;
+    bool Attach(const unsigned char* data, size_t size);
+
+    // Solid cells merged greedily into boxes. Every box lies inside a hull or
+    // a closed mesh part, so anything it blocks the source geometry blocks too.
+    std::vector<AABB> ExtractSolidBoxes() const;
+
+    bool IsBuilt() const { return cellData != nullptr; }
+    float GetCellSize() const { return cellSize; }
+
+private:
+    Vec3 origin;
+    float cellSize;
+    int dims[3];
+    int brickDims[3];
+    std::vector<uint8_t> cells;
+    std::vector<uint8_t> bricks;
+    const uint8_t* cellData;
+    const uint8_t* brickData;
+
+    size_t CellIndex(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * dims[1] + y) * dims[0] + x;
+    }
+    size_t BrickIndex(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * brickDims[1] + y) * brickDims[0] + x;
+    }
+
+    void MarkTriangle(const TriangleCombined& tri);
+    void MarkSolidCells(const std::vector<TriangleCombined>& mesh);
+    void MarkHull(const HullCombined& hull);
+    void BuildBricks();
+    bool CellOf(const Vec3& p, int cell[3]) const;
+};
@@ -2,8 +2,9 @@
 #include <string>
 #include <vector>
 
-// Forward declaration
+// Forward declarations
 struct TriangleCombined;
+struct HullCombined;
 
 // OptimizedGeometry class for loading and saving .opt files
 // Standalone version - no game dependencies
@@ -12,11 +13,23 @@ public:
     // Meshes loaded from file (vector of triangle lists)
     std::vector<std::vector<TriangleCombined>> meshes;
 
+    // Convex hull sets, stored in an optional section after the meshes
+    std::vector<std::vector<HullCombined>> hulls;
+
     // Load optimized geometry from .opt file
     bool LoadFromFile(const std::string& optimizedFile);
 
     // Create optimized file from raw .vphys file
     // Uses Parser to parse the .vphys file, then saves as .opt
     bool CreateOptimizedFile(const std::string& rawFile, const std::string& optimizedFile);
+
+    // Write a simplified occluder for the loaded geometry as an .opt file.
+    // The solid interior of hulls and of mesh parts proven closed is
+    // voxelized at cellSize and merged into boxes; open meshes contribute
+    // nothing. The occluder lies strictly inside the original geometry, so
+    // whatever it blocks is blocked in full detail. The grid is stored after
+    // the boxes so Occluder can skip queries with an endpoint in or next to
+    // geometry.
+    bool CreateOccluderFile(const std::string& occluderFile, float cellSize = 16.0f) const;
 };
 
@@ -13,8 +13,10 @@
 #include <memory>
 #include "Types.h"
 
-// Forward declaration
+// Forward declarations
 struct TriangleCombined;
+struct HullCombined;
+struct HullPlane;
 
 // Parser for .vphys files (Source 2 physics files)
 // Standalone version - no game dependencies
@@ -33,15 +35,18 @@ private:
     std::vector<std::vector<Triangle>> TrianglesList;
     std::vector<std::vector<Vec3>> VerticesList;
     std::vector<std::vector<TriangleCombined>> CombinedList;
+    std::vector<HullCombined> HullList;
 
     std::vector<std::vector<Triangle>> GetTriangles();
     std::vector<std::vector<Vec3>> GetVertices();
+    std::vector<HullCombined> GetHulls();
 
     template<typename T>
     std::vector<T> ParseElements(const unsigned char* data, size_t dataSize);
 
     template<typename T>
-    std::vector<std::vector<T>> ParseSection(const unsigned char* fileData, size_t fileSize, const std::string& sectionName);
+    std::vector<std::vector<T>> ParseSection(const unsigned char* fileData, size_t fileSize,
+        const std::string& containerName, const std::string& sectionName);
 
     void fetchTriangles() {
         TrianglesList = GetTriangles();
@@ -51,11 +56,20 @@ private:
         VerticesList = GetVertices();
     }
 
+    void fetchHulls() {
+        HullList = GetHulls();
+    }
+
 public:
     Parser(const std::string& path);
 
     const std::vector<std::vector<TriangleCombined>>& GetCombinedList() const {
         return CombinedList;
     }
+
+    // Convex hulls of the m_hulls section, kept as planes instead of triangles
+    const std::vector<HullCombined>& GetHullList() const {
+        return HullList;
+    }
 };
 
@@ -0,0 +1,102 @@
+#pragma once
+#include "Types.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+// One traced visibility query
+struct TraceRecord {
+    Vec3 from;
+    Vec3 to;
+    uint32_t latencyNanoseconds;    // 0 when the trace does not record latency
+    uint32_t visible;
+};
+
+// Binary trace of visibility queries for offline replay (tools/VisCheckReplay).
+// Every recording thread fills its own chunk of records without locking and
+// hands full chunks to a background thread that appends them to the file and
+// returns them for reuse. A thread takes a lock once, the first time it
+// records into a trace. If the writer falls behind, records are dropped and
+// counted rather than stalling queries.
+class QueryTrace {
+public:
+    static constexpr size_t RECORDS_PER_CHUNK = 4096;
+    static constexpr size_t MAX_CHUNKS_PER_THREAD = 8;
+
+    QueryTrace(const QueryTrace&) = delete;
+    QueryTrace& operator=(const QueryTrace&) = delete;
+    ~QueryTrace();
+
+    // Create the trace file and start the background writer
+    static std::shared_ptr<QueryTrace> Create(const std::string& path, bool recordLatency);
+
+    // Safe to call from any number of threads while recording
+    void Record(const Vec3& from, const Vec3& to, bool visible, uint32_t latencyNanoseconds);
+
+    // Stop recording, write all buffered records and close the file.
+    // Later Record calls are ignored.
+    bool Stop();
+
+    bool IsRecording() const { return recording.load(std::memory_order_relaxed); }
+    bool RecordsLatency() const { return recordLatency; }
+    uint64_t GetWrittenCount() const { return writtenRecords.load(std::memory_order_relaxed); }
+    uint64_t GetDroppedCount() const { return droppedRecords.load(std::memory_order_relaxed); }
+
+    // Read a trace written by Stop or cut short by a crash; a trailing
+    // partial record is ignored
+    static bool Load(const std::string& path, std::vector<TraceRecord>& records, bool* hasLatency = nullptr);
+
+private:
+    struct ThreadBuffer;
+
+    struct Chunk {
+        Chunk* next;
+        ThreadBuffer* owner;
+        size_t count;
+        TraceRecord records[RECORDS_PER_CHUNK];
+    };
+
+    struct ThreadBuffer {
+        std::thread::id thread;
+        std::atomic<bool> busy;
+        Chunk* current;
+        Chunk* spare;
+        // Chunks the writer has emptied, pushed by the writer only
+        std::atomic<Chunk*> returned;
+        size_t allocated;
+    };
+
+    explicit QueryTrace(bool recordLatency);
+
+    ThreadBuffer* AcquireBuffer();
+    Chunk* NextChunk(ThreadBuffer& buffer);
+    void Publish(Chunk* chunk);
+    void WriterLoop();
+    void WriteChunks(Chunk* list);
+
+    const bool recordLatency;
+    const uint64_t session;
+    std::atomic<bool> recording;
+    std::atomic<uint64_t> writtenRecords;
+    std::atomic<uint64_t> droppedRecords;
+
+    // Full chunks waiting for the writer, newest first
+    std::atomic<Chunk*> pending;
+
+    std::mutex registryMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+    std::mutex writerMutex;
+    std::condition_variable writerWake;
+    bool stopWriter;
+    bool writeFailed;
+    std::thread writer;
+    std::ofstream file;
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include "Types.h"
+#include "VisScene.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+// World geometry split into tiles on a regular XY grid and kept on disk.
+// Each tile is a complete VisScene (triangles, hulls and BVH) that is paged
+// in when a query segment crosses its bounds and evicted least recently used
+// once the resident tiles exceed the memory budget. Every triangle and hull
+// is owned by exactly one tile and every tile whose bounds the segment
+// touches is tested, so results match a fully loaded scene. Mesh flags are
+// kept: a tile holds one mesh per distinct flag value among its primitives.
+class TiledScene {
+public:
+    static constexpr size_t DEFAULT_MEMORY_BUDGET = 256ull * 1024 * 1024;
+    static constexpr int MAX_TILES_PER_AXIS = 1024;
+
+    TiledScene(const TiledScene&) = delete;
+    TiledScene& operator=(const TiledScene&) = delete;
+
+    // Split the geometry into tiles of tileSize world units and write them to
+    // a tiled file. tileSize is enlarged if the map would need more than
+    // MAX_TILES_PER_AXIS tiles per axis. meshFlags is empty or holds one
+    // entry per mesh followed by one per hull set, as in VisScene.
+    static bool Create(const std::string& path, const std::vector<std::vector<TriangleCombined>>& meshes,
+        const std::vector<std::vector<HullCombined>>& hullSets, float tileSize,
+        const std::vector<uint32_t>& meshFlags = std::vector<uint32_t>());
+    // Read the tile index; tile geometry is loaded on demand
+    static std::shared_ptr<TiledScene> Open(const std::string& path, size_t memoryBudget = DEFAULT_MEMORY_BUDGET);
+
+    // Safe to call from several threads. Tiles are read from disk outside the
+    // cache lock and tested outside it, so an evicted tile stays valid until
+    // its query ends.
+    // Meshes with any of ignoreFlags set are skipped.
+    bool IsVisible(const Vec3& point1, const Vec3& point2, uint32_t ignoreFlags = 0);
+
+    void SetMemoryBudget(size_t bytes);
+    size_t GetMemoryBudget() const { return memoryBudget; }
+    size_t GetTileCount() const { return tiles.size(); }
+    size_t GetResidentTileCount() const;
+    size_t GetResidentBytes() const;
+    // Number of tile reads from disk so far, including reloads after eviction
+    size_t GetTileLoadCount() const;
+
+private:
+    struct Tile {
+        AABB bounds;
+        uint64_t offset;
+        uint64_t size;
+        std::shared_ptr<const VisScene> scene;
+        std::list<uint32_t>::iterator lruPosition;
+    };
+
+    TiledScene();
+
+    std::shared_ptr<const VisScene> AcquireTile(uint32_t index);
+    void EvictOverBudget(uint32_t keep);
+    void CollectTiles(const Vec3& point1, const Vec3& point2, std::vector<uint32_t>& out) const;
+
+    Vec3 origin;
+    float tileSize;
+    int dims[2];
+    std::vector<Tile> tiles;
+    // Tiles whose bounds overlap each grid cell, bounds can reach past a cell
+    std::vector<std::vector<uint32_t>> cellTiles;
+
+    mutable std::mutex cacheMutex;
+    // Guards the shared stream; never held together with cacheMutex
+    std::mutex fileMutex;
+    std::ifstream file;
+    std::list<uint32_t> lru;
+    size_t memoryBudget;
+    size_t residentBytes;
+    size_t residentTiles;
+    size_t tileLoads;
+};
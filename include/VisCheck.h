@@ -1,75 +1,171 @@
 #pragma once
 #include "Types.h"
+#include "VisScene.h"
+#include "TiledScene.h"
+#include "QueryTrace.h"
+#include "Occluder.h"
 #include <vector>
+#include <string>
 #include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <memory>
 #include <limits>
+#include <random>
 
-#ifdef max
-#undef max
-#endif
-#ifdef min
-#undef min
-#endif
+// Packed N x N visibility bitset. Row i holds one bit per target point,
+// padded to whole 64-bit words.
+struct VisibilityMatrix {
+    size_t size = 0;
+    size_t wordsPerRow = 0;
+    std::vector<uint64_t> bits;
 
-struct AABB {
-    Vec3 min;
-    Vec3 max;
-
-    bool RayIntersects(const Vec3& rayOrigin, const Vec3& rayDir) const;
-};
-
-struct TriangleCombined {
-    Vec3 v0, v1, v2;
-
-    TriangleCombined() = default;
-    TriangleCombined(const Vec3& v0_, const Vec3& v1_, const Vec3& v2_)
-        : v0(v0_), v1(v1_), v2(v2_) {}
-
-    AABB ComputeAABB() const;
+    bool Get(size_t i, size_t j) const {
+        return (bits[i * wordsPerRow + j / 64] >> (j % 64)) & 1u;
+    }
+    const uint64_t* Row(size_t i) const {
+        return bits.data() + i * wordsPerRow;
+    }
 };
 
-struct BVHNode {
-    AABB bounds;
-    std::unique_ptr<BVHNode> left;
-    std::unique_ptr<BVHNode> right;
-    std::vector<TriangleCombined> triangles;
+// How much of a target is visible from an origin, counted in sample points.
+// When tracing stops early the untraced samples are in neither count.
+struct TargetVisibility {
+    uint32_t visible = 0;
+    uint32_t blocked = 0;
+    uint32_t total = 0;
 
-    bool IsLeaf() const {
-        return left == nullptr && right == nullptr;
-    }
+    // Visible share of all samples; a lower bound if tracing stopped early
+    float Fraction() const { return total ? static_cast<float>(visible) / total : 0.0f; }
+    bool IsComplete() const { return visible + blocked == total; }
 };
 
 class VisCheck {
 private:
-    static constexpr size_t LEAF_THRESHOLD = 4;
+    // Geometry is immutable and shared, so handles are cheap to create and
+    // several of them can query the same scene from different threads
+    std::shared_ptr<const VisScene> scene;
+    // Set instead of scene when geometry is streamed from a tiled file
+    std::shared_ptr<TiledScene> tiledScene;
+    // Optional simplified occluder tested before the full geometry
+    std::shared_ptr<const Occluder> occluder;
+    VisSceneOptions sceneOptions;
+    
+    // Uniform sample of the queries seen while recording
+    bool recordingQueries;
+    size_t maxRecordedQueries;
+    uint64_t queriesSeen;
+    std::vector<QuerySegment> recordedQueries;
+    std::minstd_rand recordRng;
     
-    std::vector<std::vector<TriangleCombined>> meshes;
-    std::vector<std::unique_ptr<BVHNode>> bvhNodes;
-    bool geometryLoaded;
+    // Full trace of IsVisible calls for offline replay
+    std::shared_ptr<QueryTrace> trace;
     
-    std::unique_ptr<BVHNode> BuildBVH(const std::vector<TriangleCombined>& tris);
-    bool IntersectBVH(const BVHNode* node, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance, float& hitDistance) const;
-    bool RayIntersectsTriangle(const Vec3& rayOrigin, const Vec3& rayDir,
-        const TriangleCombined& triangle, float& t) const;
+    size_t batchSortThreshold;
+    std::vector<std::pair<uint32_t, uint32_t>> batchOrder;
+    std::vector<std::pair<uint32_t, uint32_t>> batchScratch;
+    std::vector<Vec3> targetSamples;
     
+    void RecordQuery(const Vec3& point1, const Vec3& point2);
+    bool TraceSegment(const Vec3& point1, const Vec3& point2) const;
+    bool TraceAndLog(const Vec3& point1, const Vec3& point2);
+    uint32_t TracePacket(const Vec3& origin, const Vec3* targets, size_t count, size_t maxBlocked) const;
     bool LoadOptFile(const std::string& filePath);
-    bool SaveBVHCache(const std::string& cachePath);
-    bool LoadBVHCache(const std::string& cachePath, size_t& meshCount);
-    void SerializeBVHNode(std::ofstream& out, const BVHNode* node);
-    std::unique_ptr<BVHNode> DeserializeBVHNode(std::ifstream& in);
+    void RebuildScene();
 
 public:
     VisCheck();
+    explicit VisCheck(std::shared_ptr<const VisScene> sharedScene);
     ~VisCheck();
     
     bool LoadGeometry(const std::vector<std::vector<TriangleCombined>>& geometryMeshes);
+    // Convex hulls are tested by plane clipping; each hull set gets one BVH
+    bool LoadGeometry(const std::vector<std::vector<TriangleCombined>>& geometryMeshes,
+        const std::vector<std::vector<HullCombined>>& hullSets);
     bool LoadFromOptFile(const std::string& filePath);
     bool SaveBVHToFile(const std::string& cachePath);
     bool LoadBVHFromFile(const std::string& cachePath);
+    
+    // Occupancy grid pre-pass: segments through empty cells skip the BVH,
+    // segments through solid cells are rejected without triangle tests
+    void EnableOccupancyGrid(float cellSize = 64.0f);
+    void DisableOccupancyGrid();
+    bool IsOccupancyGridEnabled() const { return sceneOptions.occupancyCellSize > 0.0f; }
+    
+    // Share geometry with other handles or processes (see VisScene)
+    void SetScene(std::shared_ptr<const VisScene> sharedScene) { scene = std::move(sharedScene); tiledScene.reset(); }
+    std::shared_ptr<const VisScene> GetScene() const { return scene; }
+    
+    // Conservative occluder (see OptimizedGeometry::CreateOccluderFile).
+    // Segments it blocks are reported blocked without touching the full
+    // geometry; everything else, including segments with an endpoint inside
+    // an occluder box, falls through to the full BVH.
+    bool LoadOccluderFile(const std::string& filePath);
+    void SetOccluder(std::shared_ptr<const Occluder> sharedOccluder) { occluder = std::move(sharedOccluder); }
+    std::shared_ptr<const Occluder> GetOccluder() const { return occluder; }
+    
+    // Tiled worlds: write the loaded geometry as tiles, or serve queries from
+    // a tiled file while keeping at most memoryBudget bytes of tiles resident
+    bool SaveTiledFile(const std::string& path, float tileSize = 4096.0f);
+    bool LoadTiledFile(const std::string& path, size_t memoryBudget = TiledScene::DEFAULT_MEMORY_BUDGET);
+    void SetTiledScene(std::shared_ptr<TiledScene> sharedTiles) { tiledScene = std::move(sharedTiles); scene.reset(); }
+    std::shared_ptr<TiledScene> GetTiledScene() const { return tiledScene; }
+    
+    // Query recording for BVH optimization. Keeps a uniform random sample of
+    // at most maxSamples segments however long recording runs.
+    void StartQueryRecording(size_t maxSamples = 16384);
+    void StopQueryRecording() { recordingQueries = false; }
+    const std::vector<QuerySegment>& GetRecordedQueries() const { return recordedQueries; }
+    bool SaveRecordedQueries(const std::string& path) const;
+    bool LoadRecordedQueries(const std::string& path);
+    // Restructure the BVH for the recorded queries; SaveBVHToFile keeps the result
+    bool OptimizeForRecordedQueries();
+    
+    // Query trace: log every IsVisible and IsVisibleBatch query with its
+    // result (and latency if requested) for tools/VisCheckReplay. A trace
+    // can be shared by handles on several threads; StopTrace stops it for
+    // all of them and writes the remaining records.
+    bool StartTrace(const std::string& path, bool recordLatency = false);
+    bool StopTrace();
+    void SetQueryTrace(std::shared_ptr<QueryTrace> sharedTrace) { trace = std::move(sharedTrace); }
+    std::shared_ptr<QueryTrace> GetQueryTrace() const { return trace; }
+    
     bool IsVisible(const Vec3& point1, const Vec3& point2);
-    bool IsGeometryLoaded() const { return geometryLoaded; }
+    
+    // Mesh filters: give each mesh category bits (glass, grates, player
+    // clip, ...) and skip meshes with any of ignoreFlags set. Filtered
+    // queries bypass the occupancy grid and occluder and are not recorded.
+    // SaveTiledFile keeps the flags, so filters work on tiled files too.
+    bool SetMeshFlags(const std::vector<uint32_t>& flags);
+    bool IsVisible(const Vec3& point1, const Vec3& point2, uint32_t ignoreFlags);
+    // Closest hit between two points with distance, mesh, primitive and normal
+    bool Raycast(const Vec3& from, const Vec3& to, RayHit& hit, uint32_t ignoreFlags = 0) const;
+    
+    // Visibility for many unrelated segments. Batches of at least the sort
+    // threshold are traced grouped by origin cell and direction, which keeps
+    // consecutive traversals in the same part of the BVH; results[i] is the
+    // answer for segments[i] either way.
+    bool IsVisibleBatch(const std::vector<QuerySegment>& segments, std::vector<uint8_t>& results);
+    void SetBatchSortThreshold(size_t minSegments) { batchSortThreshold = minSegments; }
+    size_t GetBatchSortThreshold() const { return batchSortThreshold; }
+    
+    // Visibility between every pair of points. Each unordered pair is traced
+    // once and mirrored; a point always sees itself. Pairs are traced per
+    // origin in direction order across threadCount threads (0 picks the
+    // hardware concurrency). Not recorded by StartQueryRecording.
+    bool ComputeVisibilityMatrix(const std::vector<Vec3>& points, VisibilityMatrix& matrix, unsigned threadCount = 0);
+    
+    // Visible share of a target, traced as segments from origin to each
+    // sample point. Samples go out in small rounds first and then in packets
+    // of VisScene::MAX_PACKET_RAYS that share one traversal. With a threshold
+    // above 0, tracing stops as soon as the visible share is known to reach
+    // it or to fall short of it; a tiny threshold answers "any part visible".
+    // Not recorded by StartQueryRecording or StartTrace.
+    TargetVisibility GetTargetVisibility(const Vec3& origin, const std::vector<Vec3>& samples, float threshold = 0.0f);
+    // Samples the centers of a samplesPerAxis^3 lattice over the box, in an
+    // order that spreads the first rounds over the whole box
+    TargetVisibility GetTargetVisibility(const Vec3& origin, const AABB& target, int samplesPerAxis = 3, float threshold = 0.0f);
+    
+    bool IsGeometryLoaded() const { return scene != nullptr || tiledScene != nullptr; }
 };
 
@@ -0,0 +1,233 @@
+#pragma once
+#include "Types.h"
+#include "OccupancyGrid.h"
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef max
+#undef max
+#endif
+#ifdef min
+#undef min
+#endif
+
+struct AABB {
+    Vec3 min;
+    Vec3 max;
+
+    bool RayIntersects(const Vec3& rayOrigin, const Vec3& rayDir) const;
+};
+
+struct TriangleCombined {
+    Vec3 v0, v1, v2;
+
+    TriangleCombined() = default;
+    TriangleCombined(const Vec3& v0_, const Vec3& v1_, const Vec3& v2_)
+        : v0(v0_), v1(v1_), v2(v2_) {}
+
+    AABB ComputeAABB() const;
+};
+
+// Plane of a convex hull. Points with Dot(normal, p) <= offset are inside.
+struct HullPlane {
+    Vec3 normal;
+    float offset;
+};
+
+// Convex collision hull, tested by clipping segments against its planes
+// instead of triangulating it. bounds must enclose the hull.
+struct HullCombined {
+    std::vector<HullPlane> planes;
+    AABB bounds;
+
+    bool ContainsPoint(const Vec3& p, float tolerance = 0.0f) const;
+};
+
+// Hull as stored in a scene; planes live in a shared array
+struct SceneHull {
+    AABB bounds;
+    uint32_t firstPlane;
+    uint32_t planeCount;
+};
+
+// Flattened BVH node. Interior nodes reference their children by index and
+// leaves reference a contiguous primitive range (triangles or hulls, depending
+// on the mesh), so a scene holds no pointers and can be mapped from shared
+// memory as-is.
+struct BVHNode {
+    AABB bounds;
+    uint32_t left;
+    uint32_t right;
+    uint32_t firstPrimitive;
+    uint32_t primitiveCount;
+
+    bool IsLeaf() const {
+        return primitiveCount > 0;
+    }
+};
+
+// Per-mesh entry of a scene. Empty meshes keep their slot with rootNode set
+// to INVALID_NODE so mesh indices match the geometry that was loaded.
+// Triangle meshes come first, followed by hull sets.
+struct SceneMesh {
+    static constexpr uint32_t INVALID_NODE = 0xFFFFFFFFu;
+
+    enum PrimitiveType : uint32_t {
+        Triangles = 0,
+        Hulls = 1
+    };
+
+    uint32_t rootNode;
+    uint32_t nodeCount;
+    uint32_t firstPrimitive;
+    uint32_t primitiveCount;
+    uint32_t primitiveType;
+    // User category bits such as glass or player clip; queries can skip
+    // meshes by flag (see VisScene::WithMeshFlags)
+    uint32_t flags;
+};
+
+// Segment of a visibility query, as recorded for BVH optimization
+struct QuerySegment {
+    Vec3 from;
+    Vec3 to;
+};
+
+// Closest hit found by a raycast. primitiveIndex is the index of the triangle
+// in its mesh, or of the hull in its hull set, as the geometry was passed to
+// Build. normal is the unit surface normal facing the ray origin.
+struct RayHit {
+    float distance;
+    uint32_t meshIndex;
+    uint32_t primitiveIndex;
+    Vec3 normal;
+};
+
+struct VisSceneOptions {
+    // Cell size of the occupancy grid pre-pass, 0 disables it
+    float occupancyCellSize = 0.0f;
+};
+
+// Immutable geometry and BVH shared by any number of VisCheck handles.
+// All data lives in one position independent blob, either owned by the scene
+// or mapped read-only from a shared memory segment, so a map can be resident
+// once per host instead of once per worker. Queries are const and safe to
+// run from several threads at once.
+class VisScene {
+public:
+    static constexpr size_t LEAF_THRESHOLD = 4;
+    static constexpr int MAX_BVH_DEPTH = 64;
+    static constexpr size_t MAX_PACKET_RAYS = 32;
+
+    ~VisScene();
+    VisScene(const VisScene&) = delete;
+    VisScene& operator=(const VisScene&) = delete;
+
+    static std::shared_ptr<const VisScene> Build(const std::vector<std::vector<TriangleCombined>>& meshes,
+        const VisSceneOptions& options = VisSceneOptions());
+    static std::shared_ptr<const VisScene> Build(const std::vector<std::vector<TriangleCombined>>& meshes,
+        const std::vector<std::vector<HullCombined>>& hullSets, const VisSceneOptions& options = VisSceneOptions());
+    static std::shared_ptr<const VisScene> LoadBVHCache(const std::string& cachePath,
+        const VisSceneOptions& options = VisSceneOptions());
+    bool SaveBVHCache(const std::string& cachePath) const;
+
+    // Copy with different options, keeping the trees as they are
+    std::shared_ptr<const VisScene> WithOptions(const VisSceneOptions& options) const;
+
+    // Copy with new per-mesh flags, one entry per mesh; the flags are kept
+    // in BVH caches
+    std::shared_ptr<const VisScene> WithMeshFlags(const std::vector<uint32_t>& flags,
+        const VisSceneOptions& options = VisSceneOptions()) const;
+
+    // Return a copy whose trees are restructured for the given query
+    // distribution. Rotations are weighted by how many samples enter each
+    // node; meshes the samples do not improve keep their tree. Save the
+    // result with SaveBVHCache to reuse it.
+    std::shared_ptr<const VisScene> OptimizeForQueries(const std::vector<QuerySegment>& samples,
+        const VisSceneOptions& options = VisSceneOptions()) const;
+
+    // Wrap a scene blob read back from disk (see TiledScene)
+    static std::shared_ptr<const VisScene> FromData(std::vector<unsigned char> data);
+    const unsigned char* GetData() const { return blob; }
+
+    // Copy the scene into a new named shared memory segment and return a scene
+    // backed by it. Fails if the name is already in use; publish reloaded maps
+    // under a new name and remove the old one once workers have moved over.
+    std::shared_ptr<const VisScene> PublishShared(const std::string& name) const;
+    // Map a published scene read-only
+    static std::shared_ptr<const VisScene> OpenShared(const std::string& name);
+    // Remove the name; processes that already mapped the scene keep it
+    static bool RemoveShared(const std::string& name);
+
+    // Meshes whose flags share a bit with ignoreFlags are skipped before
+    // their tree is entered. The occupancy grid only answers unfiltered
+    // queries, since its solid cells come from every mesh.
+    bool IsVisible(const Vec3& point1, const Vec3& point2, uint32_t ignoreFlags = 0) const;
+    // Closest hit on the segment from -> to, traversing each tree front to
+    // back with node tests clipped to the segment and to the closest hit so far
+    bool Raycast(const Vec3& from, const Vec3& to, RayHit& hit, uint32_t ignoreFlags = 0) const;
+
+    // Trace the segments from origin to up to MAX_PACKET_RAYS targets with one
+    // shared traversal per mesh and return the mask of blocked segments (bit
+    // i for targets[i]). Each segment gets the same answer as IsVisible.
+    // Tracing stops, leaving the mask incomplete, as soon as more than
+    // maxBlocked segments are blocked.
+    uint32_t TracePacket(const Vec3& origin, const Vec3* targets, size_t count, size_t maxBlocked = MAX_PACKET_RAYS) const;
+
+    size_t GetMeshCount() const { return meshCount; }
+    size_t GetTriangleCount() const { return triangleCount; }
+    size_t GetHullCount() const { return hullCount; }
+    size_t GetNodeCount() const { return nodeCount; }
+    size_t GetMemoryUsage() const { return dataSize; }
+    bool IsShared() const { return mappedData != nullptr; }
+    bool HasOccupancyGrid() const { return grid.IsBuilt(); }
+    const SceneMesh& GetMesh(size_t index) const { return meshes[index]; }
+
+    // Rebuild per-mesh triangle lists and hull sets (in BVH order)
+    std::vector<std::vector<TriangleCombined>> ExtractMeshes() const;
+    std::vector<std::vector<HullCombined>> ExtractHulls() const;
+
+private:
+    VisScene();
+
+    static std::shared_ptr<const VisScene> FromMapping(void* view, size_t size, void* handle);
+    struct Parts;
+    static std::shared_ptr<const VisScene> FromParts(const Parts& parts, const VisSceneOptions& options);
+    Parts CopyParts() const;
+    bool Attach(const unsigned char* data, size_t size);
+    bool IntersectBVH(const SceneMesh& mesh, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance) const;
+    bool IntersectHull(const SceneHull& hull, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance) const;
+    bool HullEntry(const SceneHull& hull, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance,
+        float& distance, Vec3& normal) const;
+    // Input index of a primitive of the mesh, or its position in the mesh for
+    // blobs without source indices
+    uint32_t SourceIndex(const SceneMesh& mesh, uint32_t primitive) const;
+    // SourceIndex of every triangle or every hull, in scene order
+    std::vector<uint32_t> SourceIndices(uint32_t primitiveType) const;
+
+    // Either storage or a shared memory mapping backs the blob
+    std::vector<unsigned char> storage;
+    void* mappedData;
+    size_t mappedSize;
+    void* mappingHandle;
+
+    const unsigned char* blob;
+    size_t dataSize;
+    size_t meshCount;
+    size_t nodeCount;
+    size_t triangleCount;
+    size_t hullCount;
+    size_t planeCount;
+    const SceneMesh* meshes;
+    const BVHNode* nodes;
+    const TriangleCombined* triangles;
+    const SceneHull* hulls;
+    const HullPlane* planes;
+    // Input index of each triangle, then of each hull, before the BVH build
+    // reordered them; null for blobs that predate it
+    const uint32_t* sources;
+    OccupancyGrid grid;
+};
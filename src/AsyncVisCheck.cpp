@@ -0,0 +1,295 @@
+#include "AsyncVisCheck.h"
+#include "Debug.h"
+#include <chrono>
+#include <system_error>
+#include <exception>
+
+namespace {
+    // How often the loader thread checks whether retired scenes are unused
+    const auto RECLAIM_INTERVAL = std::chrono::milliseconds(50);
+}
+
+AsyncVisCheck::AsyncVisCheck(unsigned threadCount, const VisSceneOptions& options)
+    : options(options), nextTicket(1), publishedTicket(0), sceneVersion(0),
+    stopping(false), stoppingLoader(false) {
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Without threads, queries and loads run on the submitting thread
+    try {
+        loader = std::thread(&AsyncVisCheck::LoaderLoop, this);
+        for (unsigned t = 0; t < threadCount; ++t) {
+            workers.emplace_back(&AsyncVisCheck::WorkerLoop, this);
+        }
+    } catch (const std::system_error& e) {
+        DEBUG_LOG_WARNING("[AsyncVisCheck] Started " << workers.size() << " of " << threadCount << " worker threads: " << e.what());
+    }
+}
+
+AsyncVisCheck::~AsyncVisCheck() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueWake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(loaderMutex);
+        stoppingLoader = true;
+    }
+    loaderWake.notify_all();
+    if (loader.joinable()) {
+        loader.join();
+    }
+}
+
+void AsyncVisCheck::Enqueue(QueryTask task) {
+    if (workers.empty()) {
+        VisCheck handle(GetScene());
+        task(handle);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queries.push_back(std::move(task));
+    }
+    queueWake.notify_one();
+}
+
+void AsyncVisCheck::EnqueueLoad(std::function<void()> task) {
+    if (!loader.joinable()) {
+        task();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(loaderMutex);
+        loads.push_back(std::move(task));
+    }
+    loaderWake.notify_one();
+}
+
+// Each worker queries through its own handle. The handle takes the current
+// scene when a task starts and drops it when the task ends, so an idle worker
+// never keeps a replaced scene alive.
+void AsyncVisCheck::WorkerLoop() {
+    VisCheck handle;
+    std::unique_lock<std::mutex> lock(queueMutex);
+    for (;;) {
+        queueWake.wait(lock, [this]() { return stopping || !queries.empty(); });
+        if (queries.empty()) {
+            return;
+        }
+
+        QueryTask task = std::move(queries.front());
+        queries.pop_front();
+        lock.unlock();
+
+        handle.SetScene(GetScene());
+        try {
+            task(handle);
+        } catch (const std::exception& e) {
+            DEBUG_LOG_ERROR("[AsyncVisCheck] Exception in query callback: " << e.what());
+        } catch (...) {
+            DEBUG_LOG_ERROR("[AsyncVisCheck] Unknown exception in query callback");
+        }
+        handle.SetScene(nullptr);
+
+        lock.lock();
+    }
+}
+
+void AsyncVisCheck::LoaderLoop() {
+    std::unique_lock<std::mutex> lock(loaderMutex);
+    for (;;) {
+        if (loads.empty()) {
+            if (stoppingLoader) {
+                return;
+            }
+            if (GetRetiredSceneCount() > 0) {
+                loaderWake.wait_for(lock, RECLAIM_INTERVAL);
+            } else {
+                loaderWake.wait(lock);
+            }
+        }
+
+        std::function<void()> task;
+        if (!loads.empty()) {
+            task = std::move(loads.front());
+            loads.pop_front();
+        }
+        lock.unlock();
+
+        if (task) {
+            task();
+        }
+        ReclaimRetired();
+
+        lock.lock();
+    }
+}
+
+// A scene is only published if no load submitted after it has been published
+// yet, so overlapping reloads end with the most recent request
+bool AsyncVisCheck::Publish(std::shared_ptr<const VisScene> next, uint64_t ticket) {
+    std::shared_ptr<const VisScene> previous;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        if (ticket < publishedTicket) {
+            DEBUG_LOG_WARNING("[AsyncVisCheck] Discarding geometry, a newer load was published first");
+            return false;
+        }
+        publishedTicket = ticket;
+        previous = std::atomic_exchange(&current, std::move(next));
+        ++sceneVersion;
+        if (previous) {
+            retired.push_back(std::move(previous));
+        }
+    }
+
+    // Taking the loader lock orders this wakeup after the loader's check for
+    // retired scenes, so it cannot be lost
+    {
+        std::lock_guard<std::mutex> lock(loaderMutex);
+    }
+    loaderWake.notify_one();
+    return true;
+}
+
+// The last reference to a replaced scene is dropped here rather than on
+// whichever query thread happens to finish last
+void AsyncVisCheck::ReclaimRetired() {
+    std::vector<std::shared_ptr<const VisScene>> unused;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        for (size_t i = 0; i < retired.size();) {
+            // Retired scenes can no longer be acquired, so a count of one
+            // cannot go back up
+            if (retired[i].use_count() == 1) {
+                unused.push_back(std::move(retired[i]));
+                retired[i] = std::move(retired.back());
+                retired.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+std::future<bool> AsyncVisCheck::LoadGeometryAsync(std::vector<std::vector<TriangleCombined>> meshes,
+    std::vector<std::vector<HullCombined>> hullSets) {
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        ticket = nextTicket++;
+    }
+
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+    auto sharedMeshes = std::make_shared<std::vector<std::vector<TriangleCombined>>>(std::move(meshes));
+    auto sharedHulls = std::make_shared<std::vector<std::vector<HullCombined>>>(std::move(hullSets));
+
+    EnqueueLoad([this, ticket, promise, sharedMeshes, sharedHulls]() {
+        auto built = VisScene::Build(*sharedMeshes, *sharedHulls, options);
+        promise->set_value(built && Publish(std::move(built), ticket));
+    });
+    return result;
+}
+
+std::future<bool> AsyncVisCheck::LoadFromOptFileAsync(const std::string& filePath) {
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        ticket = nextTicket++;
+    }
+
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+
+    EnqueueLoad([this, ticket, promise, filePath]() {
+        VisCheck builder;
+        if (options.occupancyCellSize > 0.0f) {
+            builder.EnableOccupancyGrid(options.occupancyCellSize);
+        }
+        bool loaded = builder.LoadFromOptFile(filePath);
+        promise->set_value(loaded && Publish(builder.GetScene(), ticket));
+    });
+    return result;
+}
+
+std::future<bool> AsyncVisCheck::LoadBVHFromFileAsync(const std::string& cachePath) {
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        ticket = nextTicket++;
+    }
+
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+
+    EnqueueLoad([this, ticket, promise, cachePath]() {
+        auto loaded = VisScene::LoadBVHCache(cachePath, options);
+        promise->set_value(loaded && Publish(std::move(loaded), ticket));
+    });
+    return result;
+}
+
+void AsyncVisCheck::SetScene(std::shared_ptr<const VisScene> sharedScene) {
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        ticket = nextTicket++;
+    }
+    Publish(std::move(sharedScene), ticket);
+}
+
+std::shared_ptr<const VisScene> AsyncVisCheck::GetScene() const {
+    return std::atomic_load(&current);
+}
+
+uint64_t AsyncVisCheck::GetSceneVersion() const {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    return sceneVersion;
+}
+
+std::future<bool> AsyncVisCheck::SubmitIsVisible(const Vec3& point1, const Vec3& point2) {
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+    Enqueue([promise, point1, point2](VisCheck& handle) {
+        promise->set_value(handle.IsVisible(point1, point2));
+    });
+    return result;
+}
+
+void AsyncVisCheck::SubmitIsVisible(const Vec3& point1, const Vec3& point2, std::function<void(bool)> callback) {
+    Enqueue([callback, point1, point2](VisCheck& handle) {
+        callback(handle.IsVisible(point1, point2));
+    });
+}
+
+std::future<std::vector<uint8_t>> AsyncVisCheck::SubmitIsVisibleBatch(std::vector<QuerySegment> segments) {
+    auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+    std::future<std::vector<uint8_t>> result = promise->get_future();
+    auto sharedSegments = std::make_shared<std::vector<QuerySegment>>(std::move(segments));
+    Enqueue([promise, sharedSegments](VisCheck& handle) {
+        std::vector<uint8_t> results;
+        handle.IsVisibleBatch(*sharedSegments, results);
+        promise->set_value(std::move(results));
+    });
+    return result;
+}
+
+size_t AsyncVisCheck::GetPendingQueryCount() const {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return queries.size();
+}
+
+size_t AsyncVisCheck::GetRetiredSceneCount() const {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    return retired.size();
+}
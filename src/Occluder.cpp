@@ -0,0 +1,114 @@
+#include "Occluder.h"
+#include "OptimizedGeometry.h"
+#include "Debug.h"
+#include <fstream>
+
+namespace {
+    const uint32_t GRID_MAGIC = 0x4447434F; // "OCGD"
+    const uint32_t GRID_VERSION = 1;
+
+    // Follows the serialized grid at the very end of the file, so the .opt
+    // sections in front stay readable by OptimizedGeometry
+    struct GridFooter {
+        uint64_t gridSize;
+        uint32_t magic;
+        uint32_t version;
+    };
+}
+
+bool Occluder::AppendGrid(const std::string& path, const OccupancyGrid& grid) {
+    try {
+        std::vector<unsigned char> data(grid.SerializedSize());
+        if (data.empty()) {
+            DEBUG_LOG_ERROR("[Occluder] Occupancy grid is not built");
+            return false;
+        }
+        grid.Serialize(data.data());
+
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        if (!out) {
+            DEBUG_LOG_ERROR("[Occluder] Failed to open occluder file: " << path);
+            return false;
+        }
+        GridFooter footer = { data.size(), GRID_MAGIC, GRID_VERSION };
+        out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        out.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        out.close();
+        return static_cast<bool>(out);
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[Occluder] Exception writing occupancy grid: " << e.what());
+        return false;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[Occluder] Unknown exception writing occupancy grid");
+        return false;
+    }
+}
+
+std::shared_ptr<const Occluder> Occluder::Load(const std::string& path) {
+    try {
+        OptimizedGeometry geometry;
+        if (!geometry.LoadFromFile(path)) {
+            return nullptr;
+        }
+
+        std::shared_ptr<Occluder> occluder(new Occluder());
+        occluder->scene = VisScene::Build(geometry.meshes, geometry.hulls);
+        if (!occluder->scene) {
+            DEBUG_LOG_ERROR("[Occluder] Occluder file has no usable geometry: " << path);
+            return nullptr;
+        }
+
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(0, std::ios::end);
+        const uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+        GridFooter footer = {};
+        if (in && fileSize >= sizeof(footer)) {
+            in.seekg(static_cast<std::streamoff>(fileSize - sizeof(footer)));
+            in.read(reinterpret_cast<char*>(&footer), sizeof(footer));
+        }
+        if (!in || footer.magic != GRID_MAGIC || footer.version != GRID_VERSION
+            || footer.gridSize > fileSize - sizeof(footer)) {
+            DEBUG_LOG_ERROR("[Occluder] No occupancy grid in occluder file, recreate it with CreateOccluderFile: " << path);
+            return nullptr;
+        }
+
+        occluder->gridData.resize(static_cast<size_t>(footer.gridSize));
+        in.seekg(static_cast<std::streamoff>(fileSize - sizeof(footer) - footer.gridSize));
+        in.read(reinterpret_cast<char*>(occluder->gridData.data()), static_cast<std::streamsize>(footer.gridSize));
+        if (!in || !occluder->grid.Attach(occluder->gridData.data(), occluder->gridData.size())) {
+            DEBUG_LOG_ERROR("[Occluder] Corrupt occupancy grid in occluder file: " << path);
+            return nullptr;
+        }
+        return occluder;
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[Occluder] Exception loading occluder file: " << e.what());
+        return nullptr;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[Occluder] Unknown exception loading occluder file");
+        return nullptr;
+    }
+}
+
+bool Occluder::InEmptyCell(const Vec3& p) const {
+    return grid.StateAt(p) == OccupancyGrid::CellState::Empty;
+}
+
+// An endpoint inside solid geometry lies in a solid cell or, near the
+// surface, in a mixed one; either way the boxes may block a segment the
+// real geometry lets through
+bool Occluder::Blocks(const Vec3& point1, const Vec3& point2) const {
+    return InEmptyCell(point1) && InEmptyCell(point2) && !scene->IsVisible(point1, point2);
+}
+
+uint32_t Occluder::TracePacket(const Vec3& origin, const Vec3* targets, size_t count) const {
+    if (!InEmptyCell(origin)) {
+        return 0;
+    }
+    uint32_t blocked = scene->TracePacket(origin, targets, count);
+    for (size_t k = 0; k < count; ++k) {
+        if (((blocked >> k) & 1u) != 0 && !InEmptyCell(targets[k])) {
+            blocked &= ~(1u << k);
+        }
+    }
+    return blocked;
+}
@@ -0,0 +1,767 @@
+#include "OccupancyGrid.h"
+#include "VisScene.h"
+#include "Debug.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <utility>
+#include <cstring>
+
+namespace {
+    inline float Axis(const Vec3& v, int i) {
+        return (&v.x)[i];
+    }
+
+    inline Vec3 Sub(const Vec3& a, const Vec3& b) {
+        return Vec3(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+
+    inline float Dot(const Vec3& a, const Vec3& b) {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    inline Vec3 Cross(const Vec3& a, const Vec3& b) {
+        return Vec3(
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x
+        );
+    }
+
+    bool SeparatedOnAxis(const Vec3 v[3], const Vec3& axis, const Vec3& half) {
+        float p0 = Dot(v[0], axis);
+        float p1 = Dot(v[1], axis);
+        float p2 = Dot(v[2], axis);
+        float r = half.x * std::fabs(axis.x) + half.y * std::fabs(axis.y) + half.z * std::fabs(axis.z);
+        return std::min({ p0, p1, p2 }) > r || std::max({ p0, p1, p2 }) < -r;
+    }
+
+    // Separating axis test between a triangle and an axis-aligned box (Akenine-Moller).
+    bool TriangleOverlapsBox(const TriangleCombined& tri, const Vec3& center, const Vec3& half) {
+        const Vec3 v[3] = { Sub(tri.v0, center), Sub(tri.v1, center), Sub(tri.v2, center) };
+
+        for (int i = 0; i < 3; ++i) {
+            float lo = std::min({ Axis(v[0], i), Axis(v[1], i), Axis(v[2], i) });
+            float hi = std::max({ Axis(v[0], i), Axis(v[1], i), Axis(v[2], i) });
+            if (lo > Axis(half, i) || hi < -Axis(half, i)) {
+                return false;
+            }
+        }
+
+        const Vec3 edges[3] = { Sub(v[1], v[0]), Sub(v[2], v[1]), Sub(v[0], v[2]) };
+        const Vec3 units[3] = { Vec3(1.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f), Vec3(0.0f, 0.0f, 1.0f) };
+        for (const Vec3& edge : edges) {
+            for (const Vec3& unit : units) {
+                if (SeparatedOnAxis(v, Cross(edge, unit), half)) {
+                    return false;
+                }
+            }
+        }
+
+        return !SeparatedOnAxis(v, Cross(edges[0], edges[1]), half);
+    }
+
+    // 2D edge function evaluated with a canonical vertex order, so the shared
+    // edge of two adjacent triangles yields exactly opposite values.
+    float EdgeFunction(float ax, float ay, float bx, float by, float px, float py) {
+        bool swapped = (bx < ax) || (bx == ax && by < ay);
+        if (swapped) {
+            std::swap(ax, bx);
+            std::swap(ay, by);
+        }
+        float w = (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+        return swapped ? -w : w;
+    }
+
+    // Top-left style tie break: exactly one of an edge and its reverse owns
+    // sample points lying on it.
+    inline bool OwnsEdge(float dx, float dy) {
+        return dy > 0.0f || (dy == 0.0f && dx < 0.0f);
+    }
+
+    inline const Vec3& Corner(const TriangleCombined& tri, int i) {
+        return i == 0 ? tri.v0 : (i == 1 ? tri.v1 : tri.v2);
+    }
+
+    // Welds vertices with identical positions and keeps the edge-connected
+    // parts of the mesh in which every edge is shared by exactly two triangles
+    // with opposite winding. Parity only tells inside from outside for those;
+    // loose trim attached to the same mesh is dropped.
+    std::vector<TriangleCombined> ClosedParts(const std::vector<TriangleCombined>& mesh) {
+        std::vector<TriangleCombined> closed;
+        const size_t count = mesh.size() * 3;
+        for (size_t i = 0; i < count; ++i) {
+            const Vec3& p = Corner(mesh[i / 3], static_cast<int>(i % 3));
+            if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {
+                return closed;
+            }
+        }
+
+        auto less = [&](uint32_t a, uint32_t b) {
+            const Vec3& p = Corner(mesh[a / 3], a % 3);
+            const Vec3& q = Corner(mesh[b / 3], b % 3);
+            if (p.x != q.x) return p.x < q.x;
+            if (p.y != q.y) return p.y < q.y;
+            return p.z < q.z;
+        };
+        std::vector<uint32_t> order(count);
+        std::iota(order.begin(), order.end(), 0u);
+        std::sort(order.begin(), order.end(), less);
+
+        std::vector<uint32_t> ids(count);
+        uint32_t next = 0;
+        for (size_t k = 0; k < count; ++k) {
+            if (k > 0 && less(order[k - 1], order[k])) {
+                ++next;
+            }
+            ids[order[k]] = next;
+        }
+
+        // Undirected edges as (low vertex, high vertex, triangle, winding).
+        // Triangles collapsed by welding add no area and are left out.
+        struct Edge {
+            uint32_t lo, hi, tri;
+            bool forward;
+        };
+        std::vector<Edge> edges;
+        edges.reserve(count);
+        std::vector<uint8_t> used(mesh.size(), 0);
+        for (uint32_t t = 0; t < mesh.size(); ++t) {
+            const uint32_t v[3] = { ids[t * 3], ids[t * 3 + 1], ids[t * 3 + 2] };
+            if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0]) {
+                continue;
+            }
+            used[t] = 1;
+            for (int e = 0; e < 3; ++e) {
+                uint32_t a = v[e], b = v[(e + 1) % 3];
+                edges.push_back({ std::min(a, b), std::max(a, b), t, a < b });
+            }
+        }
+        std::sort(edges.begin(), edges.end(), [](const Edge& x, const Edge& y) {
+            return x.lo != y.lo ? x.lo < y.lo : x.hi < y.hi;
+        });
+
+        std::vector<uint32_t> parent(mesh.size());
+        std::iota(parent.begin(), parent.end(), 0u);
+        auto find = [&](uint32_t t) {
+            while (parent[t] != t) {
+                parent[t] = parent[parent[t]];
+                t = parent[t];
+            }
+            return t;
+        };
+
+        std::vector<uint8_t> open(mesh.size(), 0);
+        for (size_t i = 0; i < edges.size();) {
+            size_t j = i + 1;
+            while (j < edges.size() && edges[j].lo == edges[i].lo && edges[j].hi == edges[i].hi) {
+                parent[find(edges[j].tri)] = find(edges[i].tri);
+                ++j;
+            }
+            if (j - i != 2 || edges[i].forward == edges[i + 1].forward) {
+                open[edges[i].tri] = 1;
+            }
+            i = j;
+        }
+        for (uint32_t t = 0; t < mesh.size(); ++t) {
+            if (open[t]) {
+                open[find(t)] = 1;
+            }
+        }
+
+        for (uint32_t t = 0; t < mesh.size(); ++t) {
+            if (used[t] && !open[find(t)]) {
+                closed.push_back(mesh[t]);
+            }
+        }
+        return closed;
+    }
+
+    // Amanatides-Woo traversal of a uniform grid. Calls visit(cell, tEnter, tExit)
+    // for every cell the segment p + d * t, t in [tStart, tEnd], passes through.
+    // Returns false if visit stopped the walk.
+    template<typename Visit>
+    bool WalkGrid(const Vec3& gridOrigin, float size, const int gridDims[3],
+        const Vec3& p, const Vec3& d, float tStart, float tEnd, Visit&& visit) {
+        const float inf = std::numeric_limits<float>::infinity();
+        int cell[3], step[3];
+        float tMax[3], tDelta[3];
+
+        for (int i = 0; i < 3; ++i) {
+            float o = Axis(gridOrigin, i);
+            float pi = Axis(p, i);
+            float di = Axis(d, i);
+            float pos = pi + di * tStart;
+            cell[i] = std::clamp(static_cast<int>(std::floor((pos - o) / size)), 0, gridDims[i] - 1);
+
+            if (di > 0.0f) {
+                step[i] = 1;
+                tMax[i] = (o + (cell[i] + 1) * size - pi) / di;
+                tDelta[i] = size / di;
+            } else if (di < 0.0f) {
+                step[i] = -1;
+                tMax[i] = (o + cell[i] * size - pi) / di;
+                tDelta[i] = -size / di;
+            } else {
+                step[i] = 0;
+                tMax[i] = inf;
+                tDelta[i] = inf;
+            }
+        }
+
+        float t = tStart;
+        while (true) {
+            int axis = (tMax[0] < tMax[1]) ? ((tMax[0] < tMax[2]) ? 0 : 2) : ((tMax[1] < tMax[2]) ? 1 : 2);
+            float tNext = std::min(tMax[axis], tEnd);
+            if (!visit(cell, t, tNext)) {
+                return false;
+            }
+            if (tMax[axis] >= tEnd) {
+                return true;
+            }
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= gridDims[axis]) {
+                return true;
+            }
+            t = tMax[axis];
+            tMax[axis] += tDelta[axis];
+        }
+    }
+}
+
+namespace {
+    struct GridHeader {
+        Vec3 origin;
+        float cellSize;
+        int32_t dims[3];
+        int32_t brickDims[3];
+    };
+}
+
+OccupancyGrid::OccupancyGrid()
+    : origin(), cellSize(0.0f), dims{ 0, 0, 0 }, brickDims{ 0, 0, 0 }, cellData(nullptr), brickData(nullptr) {
+}
+
+bool OccupancyGrid::Build(const std::vector<std::vector<TriangleCombined>>& meshes,
+    const std::vector<HullCombined>& hulls, float requestedCellSize) {
+    cells.clear();
+    bricks.clear();
+    cellData = nullptr;
+    brickData = nullptr;
+
+    if (requestedCellSize <= 0.0f) {
+        return false;
+    }
+
+    const float fmax = std::numeric_limits<float>::max();
+    Vec3 lo(fmax, fmax, fmax);
+    Vec3 hi(-fmax, -fmax, -fmax);
+    bool hasGeometry = false;
+    auto extend = [&](const AABB& b) {
+        lo = Vec3(std::min(lo.x, b.min.x), std::min(lo.y, b.min.y), std::min(lo.z, b.min.z));
+        hi = Vec3(std::max(hi.x, b.max.x), std::max(hi.y, b.max.y), std::max(hi.z, b.max.z));
+        hasGeometry = true;
+    };
+    for (const auto& mesh : meshes) {
+        for (const auto& tri : mesh) {
+            extend(tri.ComputeAABB());
+        }
+    }
+    for (const auto& hull : hulls) {
+        extend(hull.bounds);
+    }
+
+    if (!hasGeometry) {
+        return false;
+    }
+
+    // One padding cell on each side keeps the border of the grid empty
+    cellSize = requestedCellSize;
+    for (int i = 0; i < 3; ++i) {
+        float extent = Axis(hi, i) - Axis(lo, i);
+        cellSize = std::max(cellSize, extent / static_cast<float>(MAX_CELLS_PER_AXIS - 2 - BRICK_SIZE));
+    }
+    origin = Vec3(lo.x - cellSize, lo.y - cellSize, lo.z - cellSize);
+
+    size_t totalCells = 1;
+    for (int i = 0; i < 3; ++i) {
+        int count = static_cast<int>(std::ceil((Axis(hi, i) - Axis(lo, i)) / cellSize)) + 2;
+        count = ((count + BRICK_SIZE - 1) / BRICK_SIZE) * BRICK_SIZE;
+        dims[i] = count;
+        brickDims[i] = count / BRICK_SIZE;
+        totalCells *= static_cast<size_t>(count);
+    }
+
+    cells.assign(totalCells, static_cast<uint8_t>(CellState::Empty));
+
+    for (const auto& mesh : meshes) {
+        for (const auto& tri : mesh) {
+            MarkTriangle(tri);
+        }
+    }
+
+    for (const auto& mesh : meshes) {
+        MarkSolidCells(mesh);
+    }
+
+    for (const auto& hull : hulls) {
+        MarkHull(hull);
+    }
+
+    BuildBricks();
+    cellData = cells.data();
+    brickData = bricks.data();
+
+    size_t counts[3] = { 0, 0, 0 };
+    for (uint8_t state : cells) {
+        counts[state]++;
+    }
+    DEBUG_LOG_INFO("[OccupancyGrid] Built " << dims[0] << "x" << dims[1] << "x" << dims[2]
+        << " grid (cell size " << cellSize << "): " << counts[0] << " empty, "
+        << counts[1] << " solid, " << counts[2] << " mixed");
+
+    return true;
+}
+
+void OccupancyGrid::MarkTriangle(const TriangleCombined& tri) {
+    // Cells are dilated slightly so grazing segments never slip past a
+    // triangle through rounding in the DDA.
+    const float eps = cellSize * 1e-3f;
+    AABB b = tri.ComputeAABB();
+
+    int lo[3], hi[3];
+    for (int i = 0; i < 3; ++i) {
+        float o = Axis(origin, i);
+        lo[i] = std::clamp(static_cast<int>(std::floor((Axis(b.min, i) - eps - o) / cellSize)), 0, dims[i] - 1);
+        hi[i] = std::clamp(static_cast<int>(std::floor((Axis(b.max, i) + eps - o) / cellSize)), 0, dims[i] - 1);
+    }
+
+    const float h = cellSize * 0.5f + eps;
+    const Vec3 half(h, h, h);
+    for (int z = lo[2]; z <= hi[2]; ++z) {
+        for (int y = lo[1]; y <= hi[1]; ++y) {
+            for (int x = lo[0]; x <= hi[0]; ++x) {
+                size_t index = CellIndex(x, y, z);
+                if (cells[index] == static_cast<uint8_t>(CellState::Mixed)) {
+                    continue;
+                }
+                Vec3 center(origin.x + (x + 0.5f) * cellSize,
+                    origin.y + (y + 0.5f) * cellSize,
+                    origin.z + (z + 0.5f) * cellSize);
+                if (TriangleOverlapsBox(tri, center, half)) {
+                    cells[index] = static_cast<uint8_t>(CellState::Mixed);
+                }
+            }
+        }
+    }
+}
+
+// Parity voxelization of the closed parts of one mesh. Rays are cast through
+// the cell centers along each axis; an untouched cell becomes solid only when
+// all three axes agree it lies inside. Open parts are skipped, and a column
+// with an odd number of crossings is ignored rather than trusted.
+void OccupancyGrid::MarkSolidCells(const std::vector<TriangleCombined>& sourceMesh) {
+    if (sourceMesh.size() < 4) {
+        return;
+    }
+
+    const std::vector<TriangleCombined> mesh = ClosedParts(sourceMesh);
+    if (mesh.size() < 4) {
+        return;
+    }
+
+    AABB bounds = mesh[0].ComputeAABB();
+    for (const auto& tri : mesh) {
+        AABB b = tri.ComputeAABB();
+        bounds.min = Vec3(std::min(bounds.min.x, b.min.x), std::min(bounds.min.y, b.min.y), std::min(bounds.min.z, b.min.z));
+        bounds.max = Vec3(std::max(bounds.max.x, b.max.x), std::max(bounds.max.y, b.max.y), std::max(bounds.max.z, b.max.z));
+    }
+
+    int lo[3], hi[3], n[3];
+    for (int i = 0; i < 3; ++i) {
+        float o = Axis(origin, i);
+        lo[i] = std::clamp(static_cast<int>(std::floor((Axis(bounds.min, i) - o) / cellSize)), 0, dims[i] - 1);
+        hi[i] = std::clamp(static_cast<int>(std::floor((Axis(bounds.max, i) - o) / cellSize)), 0, dims[i] - 1);
+        n[i] = hi[i] - lo[i] + 1;
+    }
+
+    // A mesh that does not span a full cell on every axis cannot enclose one
+    if (n[0] < 3 || n[1] < 3 || n[2] < 3) {
+        return;
+    }
+
+    std::vector<uint8_t> votes(static_cast<size_t>(n[0]) * n[1] * n[2], 0);
+
+    for (int a = 0; a < 3; ++a) {
+        const int u = (a + 1) % 3;
+        const int v = (a + 2) % 3;
+        std::vector<std::vector<float>> columns(static_cast<size_t>(n[u]) * n[v]);
+
+        for (const auto& tri : mesh) {
+            const Vec3* p[3] = { &tri.v0, &tri.v1, &tri.v2 };
+            float area = EdgeFunction(Axis(*p[0], u), Axis(*p[0], v), Axis(*p[1], u), Axis(*p[1], v), Axis(*p[2], u), Axis(*p[2], v));
+            if (area == 0.0f) {
+                continue;
+            }
+            const float sign = area > 0.0f ? 1.0f : -1.0f;
+
+            float minU = std::min({ Axis(*p[0], u), Axis(*p[1], u), Axis(*p[2], u) });
+            float maxU = std::max({ Axis(*p[0], u), Axis(*p[1], u), Axis(*p[2], u) });
+            float minV = std::min({ Axis(*p[0], v), Axis(*p[1], v), Axis(*p[2], v) });
+            float maxV = std::max({ Axis(*p[0], v), Axis(*p[1], v), Axis(*p[2], v) });
+
+            int cu0 = std::max(lo[u], static_cast<int>(std::ceil((minU - Axis(origin, u)) / cellSize - 0.5f)));
+            int cu1 = std::min(hi[u], static_cast<int>(std::floor((maxU - Axis(origin, u)) / cellSize - 0.5f)));
+            int cv0 = std::max(lo[v], static_cast<int>(std::ceil((minV - Axis(origin, v)) / cellSize - 0.5f)));
+            int cv1 = std::min(hi[v], static_cast<int>(std::floor((maxV - Axis(origin, v)) / cellSize - 0.5f)));
+
+            for (int cv = cv0; cv <= cv1; ++cv) {
+                float pv = Axis(origin, v) + (cv + 0.5f) * cellSize;
+                for (int cu = cu0; cu <= cu1; ++cu) {
+                    float pu = Axis(origin, u) + (cu + 0.5f) * cellSize;
+
+                    float w[3];
+                    bool inside = true;
+                    for (int e = 0; e < 3 && inside; ++e) {
+                        const Vec3& ea = *p[(e + 1) % 3];
+                        const Vec3& eb = *p[(e + 2) % 3];
+                        w[e] = EdgeFunction(Axis(ea, u), Axis(ea, v), Axis(eb, u), Axis(eb, v), pu, pv) * sign;
+                        float dx = (Axis(eb, u) - Axis(ea, u)) * sign;
+                        float dy = (Axis(eb, v) - Axis(ea, v)) * sign;
+                        inside = w[e] > 0.0f || (w[e] == 0.0f && OwnsEdge(dx, dy));
+                    }
+                    if (!inside) {
+                        continue;
+                    }
+
+                    float total = w[0] + w[1] + w[2];
+                    float depth = (w[0] * Axis(*p[0], a) + w[1] * Axis(*p[1], a) + w[2] * Axis(*p[2], a)) / total;
+                    columns[static_cast<size_t>(cv - lo[v]) * n[u] + (cu - lo[u])].push_back(depth);
+                }
+            }
+        }
+
+        for (int cv = lo[v]; cv <= hi[v]; ++cv) {
+            for (int cu = lo[u]; cu <= hi[u]; ++cu) {
+                auto& column = columns[static_cast<size_t>(cv - lo[v]) * n[u] + (cu - lo[u])];
+                if (column.empty() || (column.size() & 1)) {
+                    continue;
+                }
+                std::sort(column.begin(), column.end());
+
+                size_t crossed = 0;
+                for (int ca = lo[a]; ca <= hi[a]; ++ca) {
+                    float center = Axis(origin, a) + (ca + 0.5f) * cellSize;
+                    while (crossed < column.size() && column[crossed] < center) {
+                        ++crossed;
+                    }
+                    if (crossed & 1) {
+                        int c[3];
+                        c[a] = ca - lo[a];
+                        c[u] = cu - lo[u];
+                        c[v] = cv - lo[v];
+                        votes[(static_cast<size_t>(c[2]) * n[1] + c[1]) * n[0] + c[0]]++;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int z = 0; z < n[2]; ++z) {
+        for (int y = 0; y < n[1]; ++y) {
+            for (int x = 0; x < n[0]; ++x) {
+                if (votes[(static_cast<size_t>(z) * n[1] + y) * n[0] + x] != 3) {
+                    continue;
+                }
+                size_t index = CellIndex(lo[0] + x, lo[1] + y, lo[2] + z);
+                if (cells[index] == static_cast<uint8_t>(CellState::Empty)) {
+                    cells[index] = static_cast<uint8_t>(CellState::Solid);
+                }
+            }
+        }
+    }
+}
+
+// Cells whose dilated box lies entirely inside the hull are solid, even if
+// other geometry touches them; cells the hull surface may cross are mixed.
+void OccupancyGrid::MarkHull(const HullCombined& hull) {
+    if (hull.planes.empty()) {
+        return;
+    }
+
+    const float eps = cellSize * 1e-3f;
+    int lo[3], hi[3];
+    for (int i = 0; i < 3; ++i) {
+        float o = Axis(origin, i);
+        lo[i] = std::clamp(static_cast<int>(std::floor((Axis(hull.bounds.min, i) - eps - o) / cellSize)), 0, dims[i] - 1);
+        hi[i] = std::clamp(static_cast<int>(std::floor((Axis(hull.bounds.max, i) + eps - o) / cellSize)), 0, dims[i] - 1);
+    }
+
+    const float h = cellSize * 0.5f + eps;
+    for (int z = lo[2]; z <= hi[2]; ++z) {
+        for (int y = lo[1]; y <= hi[1]; ++y) {
+            for (int x = lo[0]; x <= hi[0]; ++x) {
+                Vec3 center(origin.x + (x + 0.5f) * cellSize,
+                    origin.y + (y + 0.5f) * cellSize,
+                    origin.z + (z + 0.5f) * cellSize);
+
+                bool inside = true;
+                bool outside = false;
+                for (const auto& plane : hull.planes) {
+                    float d = Dot(plane.normal, center) - plane.offset;
+                    float r = h * (std::fabs(plane.normal.x) + std::fabs(plane.normal.y) + std::fabs(plane.normal.z));
+                    if (d - r > 0.0f) {
+                        outside = true;
+                        break;
+                    }
+                    if (d + r > 0.0f) {
+                        inside = false;
+                    }
+                }
+
+                uint8_t& cell = cells[CellIndex(x, y, z)];
+                if (inside) {
+                    cell = static_cast<uint8_t>(CellState::Solid);
+                } else if (!outside && cell == static_cast<uint8_t>(CellState::Empty)) {
+                    cell = static_cast<uint8_t>(CellState::Mixed);
+                }
+            }
+        }
+    }
+}
+
+void OccupancyGrid::BuildBricks() {
+    bricks.assign(static_cast<size_t>(brickDims[0]) * brickDims[1] * brickDims[2], static_cast<uint8_t>(CellState::Mixed));
+
+    for (int bz = 0; bz < brickDims[2]; ++bz) {
+        for (int by = 0; by < brickDims[1]; ++by) {
+            for (int bx = 0; bx < brickDims[0]; ++bx) {
+                uint8_t first = cells[CellIndex(bx * BRICK_SIZE, by * BRICK_SIZE, bz * BRICK_SIZE)];
+                bool uniform = true;
+                for (int z = 0; z < BRICK_SIZE && uniform; ++z) {
+                    for (int y = 0; y < BRICK_SIZE && uniform; ++y) {
+                        for (int x = 0; x < BRICK_SIZE && uniform; ++x) {
+                            uniform = cells[CellIndex(bx * BRICK_SIZE + x, by * BRICK_SIZE + y, bz * BRICK_SIZE + z)] == first;
+                        }
+                    }
+                }
+                if (uniform) {
+                    bricks[BrickIndex(bx, by, bz)] = first;
+                }
+            }
+        }
+    }
+}
+
+size_t OccupancyGrid::SerializedSize() const {
+    if (!IsBuilt()) {
+        return 0;
+    }
+    return sizeof(GridHeader)
+        + static_cast<size_t>(dims[0]) * dims[1] * dims[2]
+        + static_cast<size_t>(brickDims[0]) * brickDims[1] * brickDims[2];
+}
+
+void OccupancyGrid::Serialize(unsigned char* out) const {
+    GridHeader header;
+    header.origin = origin;
+    header.cellSize = cellSize;
+    for (int i = 0; i < 3; ++i) {
+        header.dims[i] = dims[i];
+        header.brickDims[i] = brickDims[i];
+    }
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    size_t cellCount = static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+    std::memcpy(out, cellData, cellCount);
+    std::memcpy(out + cellCount, brickData, static_cast<size_t>(brickDims[0]) * brickDims[1] * brickDims[2]);
+}
+
+bool OccupancyGrid::Attach(const unsigned char* data, size_t size) {
+    cells.clear();
+    bricks.clear();
+    cellData = nullptr;
+    brickData = nullptr;
+
+    GridHeader header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+
+    size_t cellCount = 1;
+    size_t brickCount = 1;
+    for (int i = 0; i < 3; ++i) {
+        if (header.dims[i] <= 0 || header.dims[i] > MAX_CELLS_PER_AXIS || header.dims[i] != header.brickDims[i] * BRICK_SIZE) {
+            return false;
+        }
+        cellCount *= static_cast<size_t>(header.dims[i]);
+        brickCount *= static_cast<size_t>(header.brickDims[i]);
+    }
+    if (!(header.cellSize > 0.0f) || size != sizeof(header) + cellCount + brickCount) {
+        return false;
+    }
+
+    origin = header.origin;
+    cellSize = header.cellSize;
+    for (int i = 0; i < 3; ++i) {
+        dims[i] = header.dims[i];
+        brickDims[i] = header.brickDims[i];
+    }
+    cellData = data + sizeof(header);
+    brickData = cellData + cellCount;
+    return true;
+}
+
+std::vector<AABB> OccupancyGrid::ExtractSolidBoxes() const {
+    std::vector<AABB> boxes;
+    if (!IsBuilt()) {
+        return boxes;
+    }
+
+    std::vector<uint8_t> used(static_cast<size_t>(dims[0]) * dims[1] * dims[2], 0);
+    auto available = [&](int x, int y, int z) {
+        size_t index = CellIndex(x, y, z);
+        return !used[index] && cellData[index] == static_cast<uint8_t>(CellState::Solid);
+    };
+    auto spanAvailable = [&](int x0, int x1, int y0, int y1, int z0, int z1) {
+        for (int z = z0; z <= z1; ++z) {
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    if (!available(x, y, z)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    };
+
+    // Grow each box along x, then y, then z while the whole face stays solid
+    for (int z = 0; z < dims[2]; ++z) {
+        for (int y = 0; y < dims[1]; ++y) {
+            for (int x = 0; x < dims[0]; ++x) {
+                if (!available(x, y, z)) {
+                    continue;
+                }
+                int x1 = x;
+                while (x1 + 1 < dims[0] && available(x1 + 1, y, z)) {
+                    ++x1;
+                }
+                int y1 = y;
+                while (y1 + 1 < dims[1] && spanAvailable(x, x1, y1 + 1, y1 + 1, z, z)) {
+                    ++y1;
+                }
+                int z1 = z;
+                while (z1 + 1 < dims[2] && spanAvailable(x, x1, y, y1, z1 + 1, z1 + 1)) {
+                    ++z1;
+                }
+
+                for (int cz = z; cz <= z1; ++cz) {
+                    for (int cy = y; cy <= y1; ++cy) {
+                        for (int cx = x; cx <= x1; ++cx) {
+                            used[CellIndex(cx, cy, cz)] = 1;
+                        }
+                    }
+                }
+
+                AABB box;
+                box.min = Vec3(origin.x + x * cellSize, origin.y + y * cellSize, origin.z + z * cellSize);
+                box.max = Vec3(origin.x + (x1 + 1) * cellSize, origin.y + (y1 + 1) * cellSize, origin.z + (z1 + 1) * cellSize);
+                boxes.push_back(box);
+            }
+        }
+    }
+    return boxes;
+}
+
+bool OccupancyGrid::CellOf(const Vec3& p, int cell[3]) const {
+    for (int i = 0; i < 3; ++i) {
+        float f = std::floor((Axis(p, i) - Axis(origin, i)) / cellSize);
+        if (!(f >= 0.0f && f < static_cast<float>(dims[i]))) {
+            return false;
+        }
+        cell[i] = static_cast<int>(f);
+    }
+    return true;
+}
+
+OccupancyGrid::CellState OccupancyGrid::StateAt(const Vec3& p) const {
+    int cell[3];
+    if (!IsBuilt() || !CellOf(p, cell)) {
+        return CellState::Empty;
+    }
+    return static_cast<CellState>(cellData[CellIndex(cell[0], cell[1], cell[2])]);
+}
+
+OccupancyGrid::Verdict OccupancyGrid::Classify(const Vec3& from, const Vec3& to) const {
+    if (!IsBuilt()) {
+        return Verdict::Unknown;
+    }
+
+    int cell[3];
+    if (CellOf(from, cell) && cellData[CellIndex(cell[0], cell[1], cell[2])] == static_cast<uint8_t>(CellState::Solid)) {
+        return Verdict::Unknown;
+    }
+    if (CellOf(to, cell) && cellData[CellIndex(cell[0], cell[1], cell[2])] == static_cast<uint8_t>(CellState::Solid)) {
+        return Verdict::Unknown;
+    }
+
+    // Clip the segment to the grid; everything outside it is empty space
+    Vec3 d = Sub(to, from);
+    float t0 = 0.0f;
+    float t1 = 1.0f;
+    for (int i = 0; i < 3; ++i) {
+        float o = Axis(origin, i);
+        float extent = o + dims[i] * cellSize;
+        float p = Axis(from, i);
+        float di = Axis(d, i);
+        if (di == 0.0f) {
+            if (p < o || p > extent) {
+                return Verdict::Visible;
+            }
+            continue;
+        }
+        float ta = (o - p) / di;
+        float tb = (extent - p) / di;
+        if (ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    if (t0 > t1) {
+        return Verdict::Visible;
+    }
+
+    bool sawMixed = false;
+    bool blocked = false;
+    const float brickSize = cellSize * BRICK_SIZE;
+
+    WalkGrid(origin, brickSize, brickDims, from, d, t0, t1, [&](const int brick[3], float tEnter, float tExit) {
+        uint8_t state = brickData[BrickIndex(brick[0], brick[1], brick[2])];
+        if (state == static_cast<uint8_t>(CellState::Empty)) {
+            return true;
+        }
+        if (state == static_cast<uint8_t>(CellState::Solid)) {
+            blocked = true;
+            return false;
+        }
+        return WalkGrid(origin, cellSize, dims, from, d, tEnter, tExit, [&](const int c[3], float, float) {
+            uint8_t cellState = cellData[CellIndex(c[0], c[1], c[2])];
+            if (cellState == static_cast<uint8_t>(CellState::Solid)) {
+                blocked = true;
+                return false;
+            }
+            if (cellState == static_cast<uint8_t>(CellState::Mixed)) {
+                sawMixed = true;
+            }
+            return true;
+        });
+    });
+
+    if (blocked) {
+        return Verdict::Blocked;
+    }
+    return sawMixed ? Verdict::Unknown : Verdict::Visible;
+}
@@ -1,14 +1,14 @@
 #include "OptimizedGeometry.h"
 #include "Parser.h"
 #include "VisCheck.h"
+#include "OccupancyGrid.h"
+#include "Occluder.h"
+#include "Debug.h"
 #include <fstream>
 #include <iostream>
 
-bool OptimizedGeometry::CreateOptimizedFile(const std::string& rawFile, const std::string& optimizedFile) {
-    // Use Parser to parse the raw .vphys file
-    Parser parser(rawFile);
-    meshes = parser.GetCombinedList();
-
+static bool WriteOptFile(const std::string& optimizedFile, const std::vector<std::vector<TriangleCombined>>& meshes,
+    const std::vector<std::vector<HullCombined>>& hulls) {
     std::ofstream out(optimizedFile, std::ios::binary);
     if (!out) {
         std::cerr << "Failed to create output file: " << optimizedFile << std::endl;
@@ -31,10 +31,83 @@ bool OptimizedGeometry::CreateOptimizedFile(const std::string& rawFile, const st
         }
     }
     
+    // Hull section; readers that predate it stop after the meshes
+    size_t numHullSets = hulls.size();
+    out.write(reinterpret_cast<const char*>(&numHullSets), sizeof(size_t));
+    
+    for (const auto& hullSet : hulls) {
+        size_t numHulls = hullSet.size();
+        out.write(reinterpret_cast<const char*>(&numHulls), sizeof(size_t));
+        
+        for (const auto& hull : hullSet) {
+            size_t numPlanes = hull.planes.size();
+            out.write(reinterpret_cast<const char*>(&hull.bounds.min), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&hull.bounds.max), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&numPlanes), sizeof(size_t));
+            out.write(reinterpret_cast<const char*>(hull.planes.data()), numPlanes * sizeof(HullPlane));
+        }
+    }
+    
     out.close();
     return true;
 }
 
+bool OptimizedGeometry::CreateOptimizedFile(const std::string& rawFile, const std::string& optimizedFile) {
+    // Use Parser to parse the raw .vphys file
+    Parser parser(rawFile);
+    meshes = parser.GetCombinedList();
+    hulls.clear();
+    if (!parser.GetHullList().empty()) {
+        hulls.push_back(parser.GetHullList());
+    }
+
+    return WriteOptFile(optimizedFile, meshes, hulls);
+}
+
+bool OptimizedGeometry::CreateOccluderFile(const std::string& occluderFile, float cellSize) const {
+    std::vector<HullCombined> allHulls;
+    for (const auto& hullSet : hulls) {
+        allHulls.insert(allHulls.end(), hullSet.begin(), hullSet.end());
+    }
+
+    // Only hulls and closed mesh parts yield solid cells, so every box below
+    // is enclosed by real geometry
+    OccupancyGrid grid;
+    if (!grid.Build(meshes, allHulls, cellSize)) {
+        std::cerr << "Failed to voxelize geometry for occluder: " << occluderFile << std::endl;
+        return false;
+    }
+
+    // Each box becomes 12 triangles with outward facing winding
+    static const int faces[6][4] = {
+        { 0, 2, 3, 1 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 },
+        { 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 }
+    };
+    std::vector<TriangleCombined> occluder;
+    std::vector<AABB> boxes = grid.ExtractSolidBoxes();
+    for (const AABB& box : boxes) {
+        Vec3 corners[8];
+        for (int i = 0; i < 8; ++i) {
+            corners[i] = Vec3((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z);
+        }
+        for (const auto& face : faces) {
+            occluder.emplace_back(corners[face[0]], corners[face[1]], corners[face[2]]);
+            occluder.emplace_back(corners[face[0]], corners[face[2]], corners[face[3]]);
+        }
+    }
+
+    DEBUG_LOG_INFO("[OptimizedGeometry] Occluder: " << boxes.size() << " boxes, " << occluder.size()
+        << " triangles (cell size " << grid.GetCellSize() << ")");
+    if (occluder.empty()) {
+        std::cerr << "No solid volume found for occluder: " << occluderFile << std::endl;
+        return false;
+    }
+
+    // The grid goes along so queries starting or ending inside geometry can
+    // bypass the occluder
+    return WriteOptFile(occluderFile, { occluder }, {}) && Occluder::AppendGrid(occluderFile, grid);
+}
+
 bool OptimizedGeometry::LoadFromFile(const std::string& optimizedFile) {
     std::ifstream in(optimizedFile, std::ios::binary);
     if (!in) {
@@ -62,6 +135,54 @@ bool OptimizedGeometry::LoadFromFile(const std::string& optimizedFile) {
         meshes.push_back(mesh);
     }
     
+    hulls.clear();
+    size_t numHullSets = 0;
+    if (in.read(reinterpret_cast<char*>(&numHullSets), sizeof(size_t))) {
+        // Counts larger than the rest of the file could hold mean the section
+        // is corrupt; failing the stream rejects it below.
+        const std::streamoff sectionStart = in.tellg();
+        in.seekg(0, std::ios::end);
+        const size_t remainingBytes = static_cast<size_t>(in.tellg() - sectionStart);
+        in.seekg(sectionStart);
+        const size_t minHullBytes = 2 * sizeof(Vec3) + sizeof(size_t);
+
+        if (numHullSets > remainingBytes / sizeof(size_t)) {
+            in.setstate(std::ios::failbit);
+        }
+        for (size_t i = 0; i < numHullSets && in; ++i) {
+            size_t numHulls = 0;
+            in.read(reinterpret_cast<char*>(&numHulls), sizeof(size_t));
+            if (in && numHulls > remainingBytes / minHullBytes) {
+                in.setstate(std::ios::failbit);
+                break;
+            }
+            
+            std::vector<HullCombined> hullSet;
+            for (size_t j = 0; j < numHulls && in; ++j) {
+                HullCombined hull;
+                size_t numPlanes = 0;
+                in.read(reinterpret_cast<char*>(&hull.bounds.min), sizeof(Vec3));
+                in.read(reinterpret_cast<char*>(&hull.bounds.max), sizeof(Vec3));
+                in.read(reinterpret_cast<char*>(&numPlanes), sizeof(size_t));
+                if (in && numPlanes > 0xFFFF) {
+                    in.setstate(std::ios::failbit);
+                }
+                if (!in) {
+                    break;
+                }
+                hull.planes.resize(numPlanes);
+                in.read(reinterpret_cast<char*>(hull.planes.data()), numPlanes * sizeof(HullPlane));
+                hullSet.push_back(std::move(hull));
+            }
+            hulls.push_back(std::move(hullSet));
+        }
+        
+        if (!in) {
+            std::cerr << "Corrupt or truncated hull section in: " << optimizedFile << std::endl;
+            hulls.clear();
+        }
+    }
+    
     in.close();
     return true;
 }
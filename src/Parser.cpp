@@ -8,6 +8,7 @@
 #include <cctype>
 #include <cstring>
 #include <thread>
+#include <cmath>
 
 static std::vector<unsigned char> HexStringToBytes(const std::string& hex) {
     std::string hexCleaned;
@@ -32,9 +33,11 @@ static std::vector<unsigned char> HexStringToBytes(const std::string& hex) {
 Parser::Parser(const std::string& path) : DataPath(path) {
     std::thread trianglesThread(&Parser::fetchTriangles, this);
     std::thread verticesThread(&Parser::fetchVertices, this);
+    std::thread hullsThread(&Parser::fetchHulls, this);
 
     trianglesThread.join();
     verticesThread.join();
+    hullsThread.join();
 
     for (size_t i = 0; i < TrianglesList.size(); ++i) {
         const std::vector<Triangle>& triangles = TrianglesList[i];
@@ -62,7 +65,7 @@ std::vector<T> Parser::ParseElements(const unsigned char* data, size_t dataSize)
     size_t elementSize = sizeof(T);
     elements.reserve(dataSize / elementSize);
 
-    for (size_t i = 0; i < dataSize; i += elementSize) {
+    for (size_t i = 0; i + elementSize <= dataSize; i += elementSize) {
         T element;
         std::memcpy(&element, data + i, elementSize);
         elements.push_back(element);
@@ -72,18 +75,23 @@ std::vector<T> Parser::ParseElements(const unsigned char* data, size_t dataSize)
 }
 
 template<typename T>
-std::vector<std::vector<T>> Parser::ParseSection(const unsigned char* fileData, size_t fileSize, const std::string& sectionName) {
+std::vector<std::vector<T>> Parser::ParseSection(const unsigned char* fileData, size_t fileSize,
+    const std::string& containerName, const std::string& sectionName) {
+    static const char* containers[] = { "m_spheres", "m_capsules", "m_hulls", "m_meshes" };
+
     std::vector<std::vector<T>> elementsLists;
     std::istringstream fileStream(std::string(reinterpret_cast<const char*>(fileData), fileSize));
     std::string line;
-    bool inMeshSection = false;
+    std::string currentContainer;
 
     while (std::getline(fileStream, line)) {
-        if (line.find("m_meshes") != std::string::npos) {
-            inMeshSection = true;
+        for (const char* container : containers) {
+            if (line.find(container) != std::string::npos) {
+                currentContainer = container;
+            }
         }
 
-        if (inMeshSection && line.find(sectionName) != std::string::npos) {
+        if (currentContainer == containerName && line.find(sectionName) != std::string::npos) {
             std::getline(fileStream, line);
             if (line.find("#[") != std::string::npos) {
                 std::string hexString;
@@ -113,7 +121,7 @@ std::vector<std::vector<Triangle>> Parser::GetTriangles() {
     std::vector<unsigned char> fileData(fileSize);
     file.read(reinterpret_cast<char*>(fileData.data()), fileSize);
 
-    return ParseSection<Triangle>(fileData.data(), fileSize, "m_Triangles");
+    return ParseSection<Triangle>(fileData.data(), fileSize, "m_meshes", "m_Triangles");
 }
 
 std::vector<std::vector<Vec3>> Parser::GetVertices() {
@@ -129,12 +137,90 @@ std::vector<std::vector<Vec3>> Parser::GetVertices() {
     std::vector<unsigned char> fileData(fileSize);
     file.read(reinterpret_cast<char*>(fileData.data()), fileSize);
 
-    return ParseSection<Vec3>(fileData.data(), fileSize, "m_Vertices");
+    return ParseSection<Vec3>(fileData.data(), fileSize, "m_meshes", "m_Vertices");
+}
+
+static bool HullContainsVertices(const HullCombined& hull, const std::vector<Vec3>& vertices) {
+    for (const Vec3& v : vertices) {
+        if (!hull.ContainsPoint(v, 0.01f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<HullCombined> Parser::GetHulls() {
+    std::ifstream file(DataPath, std::ios::binary);
+    if (!file.is_open()) {
+        return {};
+    }
+
+    file.seekg(0, std::ios::end);
+    size_t fileSize = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    std::vector<unsigned char> fileData(fileSize);
+    file.read(reinterpret_cast<char*>(fileData.data()), fileSize);
+
+    auto planeLists = ParseSection<HullPlane>(fileData.data(), fileSize, "m_hulls", "m_Planes");
+    // Newer files keep positions in m_VertexPositions and per-vertex edge
+    // links in m_Vertices; older ones store positions in m_Vertices
+    auto vertexLists = ParseSection<Vec3>(fileData.data(), fileSize, "m_hulls", "m_VertexPositions");
+    if (vertexLists.size() != planeLists.size()) {
+        vertexLists = ParseSection<Vec3>(fileData.data(), fileSize, "m_hulls", "m_Vertices");
+    }
+    if (vertexLists.size() != planeLists.size()) {
+        if (!planeLists.empty()) {
+            std::cerr << "Hull planes and vertices do not pair up, hulls ignored: " << DataPath << std::endl;
+        }
+        return {};
+    }
+
+    std::vector<HullCombined> hulls;
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < planeLists.size(); ++i) {
+        const std::vector<Vec3>& vertices = vertexLists[i];
+        if (planeLists[i].size() < 4 || vertices.empty()) {
+            ++skipped;
+            continue;
+        }
+
+        HullCombined hull;
+        hull.planes = std::move(planeLists[i]);
+        hull.bounds.min = hull.bounds.max = vertices[0];
+        for (const Vec3& v : vertices) {
+            hull.bounds.min = Vec3(std::min(hull.bounds.min.x, v.x), std::min(hull.bounds.min.y, v.y), std::min(hull.bounds.min.z, v.z));
+            hull.bounds.max = Vec3(std::max(hull.bounds.max.x, v.x), std::max(hull.bounds.max.y, v.y), std::max(hull.bounds.max.z, v.z));
+        }
+
+        // The vertices must lie inside every plane; accept the opposite offset
+        // sign as well and drop hulls that match neither convention
+        if (!HullContainsVertices(hull, vertices)) {
+            for (HullPlane& plane : hull.planes) {
+                plane.offset = -plane.offset;
+            }
+            if (!HullContainsVertices(hull, vertices)) {
+                ++skipped;
+                continue;
+            }
+        }
+
+        hulls.push_back(std::move(hull));
+    }
+
+    if (skipped > 0) {
+        std::cerr << "Skipped " << skipped << " malformed hulls in: " << DataPath << std::endl;
+    }
+
+    return hulls;
 }
 
 // Explicit template instantiations to ensure they're compiled
 template std::vector<Triangle> Parser::ParseElements<Triangle>(const unsigned char* data, size_t dataSize);
 template std::vector<Vec3> Parser::ParseElements<Vec3>(const unsigned char* data, size_t dataSize);
-template std::vector<std::vector<Triangle>> Parser::ParseSection<Triangle>(const unsigned char* fileData, size_t fileSize, const std::string& sectionName);
-template std::vector<std::vector<Vec3>> Parser::ParseSection<Vec3>(const unsigned char* fileData, size_t fileSize, const std::string& sectionName);
+template std::vector<HullPlane> Parser::ParseElements<HullPlane>(const unsigned char* data, size_t dataSize);
+template std::vector<std::vector<Triangle>> Parser::ParseSection<Triangle>(const unsigned char* fileData, size_t fileSize, const std::string& containerName, const std::string& sectionName);
+template std::vector<std::vector<Vec3>> Parser::ParseSection<Vec3>(const unsigned char* fileData, size_t fileSize, const std::string& containerName, const std::string& sectionName);
+template std::vector<std::vector<HullPlane>> Parser::ParseSection<HullPlane>(const unsigned char* fileData, size_t fileSize, const std::string& containerName, const std::string& sectionName);
 
@@ -0,0 +1,303 @@
+#include "QueryTrace.h"
+#include "Debug.h"
+#include <chrono>
+#include <new>
+#include <system_error>
+
+namespace {
+    const uint32_t TRACE_MAGIC = 0x43525456; // "VTRC"
+    const uint32_t TRACE_VERSION = 1;
+    const uint32_t TRACE_FLAG_LATENCY = 1;
+
+    // How often the background writer drains full chunks
+    const auto FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+    struct TraceHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t flags;
+        uint32_t recordSize;
+    };
+
+    std::atomic<uint64_t> nextSession(1);
+}
+
+QueryTrace::QueryTrace(bool recordLatency)
+    : recordLatency(recordLatency), session(nextSession.fetch_add(1)), recording(false),
+    writtenRecords(0), droppedRecords(0), pending(nullptr), stopWriter(false), writeFailed(false) {
+}
+
+QueryTrace::~QueryTrace() {
+    Stop();
+
+    for (auto& buffer : buffers) {
+        Chunk* lists[] = { buffer->current, buffer->spare, buffer->returned.load() };
+        for (Chunk* chunk : lists) {
+            while (chunk) {
+                Chunk* next = chunk->next;
+                delete chunk;
+                chunk = next;
+            }
+        }
+    }
+}
+
+std::shared_ptr<QueryTrace> QueryTrace::Create(const std::string& path, bool recordLatency) {
+    std::shared_ptr<QueryTrace> trace(new QueryTrace(recordLatency));
+
+    trace->file.open(path, std::ios::binary | std::ios::trunc);
+    if (!trace->file) {
+        DEBUG_LOG_ERROR("[QueryTrace] Failed to create trace file: " << path);
+        return nullptr;
+    }
+
+    TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, recordLatency ? TRACE_FLAG_LATENCY : 0u,
+        static_cast<uint32_t>(sizeof(TraceRecord)) };
+    trace->file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!trace->file) {
+        DEBUG_LOG_ERROR("[QueryTrace] Failed to write trace header: " << path);
+        return nullptr;
+    }
+
+    trace->recording.store(true);
+    try {
+        trace->writer = std::thread(&QueryTrace::WriterLoop, trace.get());
+    } catch (const std::system_error& e) {
+        DEBUG_LOG_ERROR("[QueryTrace] Failed to start trace writer: " << e.what());
+        trace->recording.store(false);
+        return nullptr;
+    }
+
+    DEBUG_LOG_INFO("[QueryTrace] Recording queries to " << path);
+    return trace;
+}
+
+// Each thread caches its buffer for the trace it last recorded into; the
+// registry lock is only taken on a cache miss
+QueryTrace::ThreadBuffer* QueryTrace::AcquireBuffer() {
+    static thread_local uint64_t cachedSession = 0;
+    static thread_local ThreadBuffer* cachedBuffer = nullptr;
+
+    if (cachedSession == session) {
+        return cachedBuffer;
+    }
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    const std::thread::id self = std::this_thread::get_id();
+    ThreadBuffer* found = nullptr;
+    for (auto& buffer : buffers) {
+        if (buffer->thread == self) {
+            found = buffer.get();
+            break;
+        }
+    }
+
+    if (!found) {
+        std::unique_ptr<ThreadBuffer> buffer(new ThreadBuffer());
+        buffer->thread = self;
+        buffer->busy.store(false);
+        buffer->current = nullptr;
+        buffer->spare = nullptr;
+        buffer->returned.store(nullptr);
+        buffer->allocated = 0;
+        found = buffer.get();
+        buffers.push_back(std::move(buffer));
+    }
+
+    cachedSession = session;
+    cachedBuffer = found;
+    return found;
+}
+
+QueryTrace::Chunk* QueryTrace::NextChunk(ThreadBuffer& buffer) {
+    if (!buffer.spare) {
+        buffer.spare = buffer.returned.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    Chunk* chunk = buffer.spare;
+    if (chunk) {
+        buffer.spare = chunk->next;
+    } else if (buffer.allocated < MAX_CHUNKS_PER_THREAD) {
+        chunk = new (std::nothrow) Chunk;
+        if (!chunk) {
+            return nullptr;
+        }
+        chunk->owner = &buffer;
+        ++buffer.allocated;
+    } else {
+        return nullptr;
+    }
+
+    chunk->next = nullptr;
+    chunk->count = 0;
+    return chunk;
+}
+
+void QueryTrace::Publish(Chunk* chunk) {
+    Chunk* head = pending.load(std::memory_order_relaxed);
+    do {
+        chunk->next = head;
+    } while (!pending.compare_exchange_weak(head, chunk, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void QueryTrace::Record(const Vec3& from, const Vec3& to, bool visible, uint32_t latencyNanoseconds) {
+    if (!recording.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    ThreadBuffer* buffer = AcquireBuffer();
+
+    // Stop waits for busy to clear after turning recording off, so a buffer
+    // is never touched by its thread once Stop starts draining it
+    buffer->busy.store(true);
+    if (!recording.load()) {
+        buffer->busy.store(false, std::memory_order_release);
+        return;
+    }
+
+    if (!buffer->current) {
+        buffer->current = NextChunk(*buffer);
+    }
+
+    Chunk* chunk = buffer->current;
+    if (chunk) {
+        TraceRecord& record = chunk->records[chunk->count];
+        record.from = from;
+        record.to = to;
+        record.latencyNanoseconds = latencyNanoseconds;
+        record.visible = visible ? 1u : 0u;
+        if (++chunk->count == RECORDS_PER_CHUNK) {
+            Publish(chunk);
+            buffer->current = nullptr;
+        }
+    } else {
+        droppedRecords.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    buffer->busy.store(false, std::memory_order_release);
+}
+
+void QueryTrace::WriterLoop() {
+    std::unique_lock<std::mutex> lock(writerMutex);
+    while (!stopWriter) {
+        writerWake.wait_for(lock, FLUSH_INTERVAL);
+        lock.unlock();
+        WriteChunks(pending.exchange(nullptr, std::memory_order_acquire));
+        lock.lock();
+    }
+}
+
+// Writes a newest-first list of chunks in the order they were filled and
+// hands each chunk back to the thread that owns it
+void QueryTrace::WriteChunks(Chunk* list) {
+    Chunk* ordered = nullptr;
+    while (list) {
+        Chunk* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        Chunk* chunk = ordered;
+        ordered = chunk->next;
+
+        if (!writeFailed) {
+            file.write(reinterpret_cast<const char*>(chunk->records), chunk->count * sizeof(TraceRecord));
+            if (file) {
+                writtenRecords.fetch_add(chunk->count, std::memory_order_relaxed);
+            } else {
+                DEBUG_LOG_ERROR("[QueryTrace] Failed to write trace, further records are dropped");
+                writeFailed = true;
+            }
+        }
+        if (writeFailed) {
+            droppedRecords.fetch_add(chunk->count, std::memory_order_relaxed);
+        }
+
+        Chunk* head = chunk->owner->returned.load(std::memory_order_relaxed);
+        do {
+            chunk->next = head;
+        } while (!chunk->owner->returned.compare_exchange_weak(head, chunk, std::memory_order_release, std::memory_order_relaxed));
+    }
+}
+
+bool QueryTrace::Stop() {
+    std::lock_guard<std::mutex> registryLock(registryMutex);
+    recording.store(false);
+    if (!writer.joinable()) {
+        return !writeFailed;
+    }
+
+    for (auto& buffer : buffers) {
+        while (buffer->busy.load()) {
+            std::this_thread::yield();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        stopWriter = true;
+    }
+    writerWake.notify_one();
+    writer.join();
+
+    WriteChunks(pending.exchange(nullptr, std::memory_order_acquire));
+    for (auto& buffer : buffers) {
+        if (buffer->current) {
+            Chunk* chunk = buffer->current;
+            buffer->current = nullptr;
+            chunk->next = nullptr;
+            WriteChunks(chunk);
+        }
+    }
+
+    file.close();
+    if (!file) {
+        writeFailed = true;
+    }
+
+    DEBUG_LOG_INFO("[QueryTrace] Wrote " << GetWrittenCount() << " queries, dropped " << GetDroppedCount());
+    return !writeFailed;
+}
+
+bool QueryTrace::Load(const std::string& path, std::vector<TraceRecord>& records, bool* hasLatency) {
+    try {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) {
+            DEBUG_LOG_ERROR("[QueryTrace] Failed to open trace file: " << path);
+            return false;
+        }
+
+        const std::streamoff fileSize = in.tellg();
+        in.seekg(0);
+
+        TraceHeader header = {};
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+            header.recordSize != sizeof(TraceRecord)) {
+            DEBUG_LOG_ERROR("[QueryTrace] Invalid trace file: " << path);
+            return false;
+        }
+
+        const size_t numRecords = static_cast<size_t>(fileSize - static_cast<std::streamoff>(sizeof(header))) / sizeof(TraceRecord);
+        std::vector<TraceRecord> loaded(numRecords);
+        in.read(reinterpret_cast<char*>(loaded.data()), numRecords * sizeof(TraceRecord));
+        if (!in) {
+            DEBUG_LOG_ERROR("[QueryTrace] Failed to read trace file: " << path);
+            return false;
+        }
+
+        records = std::move(loaded);
+        if (hasLatency) {
+            *hasLatency = (header.flags & TRACE_FLAG_LATENCY) != 0;
+        }
+        return true;
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[QueryTrace] Exception loading trace file: " << e.what());
+        return false;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[QueryTrace] Unknown exception loading trace file");
+        return false;
+    }
+}
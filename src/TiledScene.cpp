@@ -0,0 +1,522 @@
+#include "TiledScene.h"
+#include "Debug.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace {
+    const uint32_t TILED_MAGIC = 0x4C495456; // "VTIL"
+    const uint32_t TILED_VERSION = 1;
+    const size_t TILE_ALIGNMENT = 64;
+
+    struct TiledHeader {
+        uint32_t magic;
+        uint32_t version;
+        float tileSize;
+        int32_t dims[2];
+        Vec3 origin;
+        uint64_t tileCount;
+    };
+
+    struct TileRecord {
+        AABB bounds;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    void Extend(AABB& bounds, const AABB& other) {
+        bounds.min.x = std::min(bounds.min.x, other.min.x);
+        bounds.min.y = std::min(bounds.min.y, other.min.y);
+        bounds.min.z = std::min(bounds.min.z, other.min.z);
+        bounds.max.x = std::max(bounds.max.x, other.max.x);
+        bounds.max.y = std::max(bounds.max.y, other.max.y);
+        bounds.max.z = std::max(bounds.max.z, other.max.z);
+    }
+
+    AABB EmptyBounds() {
+        const float inf = std::numeric_limits<float>::max();
+        return { Vec3(inf, inf, inf), Vec3(-inf, -inf, -inf) };
+    }
+
+    // Widen bounds so hits found right on a triangle's edge, which the
+    // triangle test may place a rounding error outside its box, still select
+    // the tile
+    void Inflate(AABB& bounds) {
+        float extent = std::max({ bounds.max.x - bounds.min.x, bounds.max.y - bounds.min.y, bounds.max.z - bounds.min.z });
+        float margin = 0.01f + extent * 1e-4f;
+        bounds.min = Vec3(bounds.min.x - margin, bounds.min.y - margin, bounds.min.z - margin);
+        bounds.max = Vec3(bounds.max.x + margin, bounds.max.y + margin, bounds.max.z + margin);
+    }
+
+    // Clip the segment from + t * delta, t in [t0, t1], against the box
+    bool ClipSegment(const AABB& bounds, const Vec3& from, const Vec3& delta, float& t0, float& t1) {
+        for (int i = 0; i < 3; ++i) {
+            float o = (&from.x)[i];
+            float d = (&delta.x)[i];
+            float lo = (&bounds.min.x)[i];
+            float hi = (&bounds.max.x)[i];
+            if (d == 0.0f) {
+                if (o < lo || o > hi) {
+                    return false;
+                }
+                continue;
+            }
+            float a = (lo - o) / d;
+            float b = (hi - o) / d;
+            if (a > b) std::swap(a, b);
+            t0 = std::max(t0, a);
+            t1 = std::min(t1, b);
+            if (t0 > t1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Split flag-tagged primitives into one list per distinct flag value
+    template<typename T>
+    void GroupByFlags(std::vector<std::pair<uint32_t, T>>& tagged, std::vector<std::vector<T>>& groups,
+        std::vector<uint32_t>& groupFlags) {
+        std::stable_sort(tagged.begin(), tagged.end(), [](const std::pair<uint32_t, T>& a, const std::pair<uint32_t, T>& b) {
+            return a.first < b.first;
+        });
+        for (size_t i = 0; i < tagged.size(); ++i) {
+            if (i == 0 || tagged[i].first != tagged[i - 1].first) {
+                groups.emplace_back();
+                groupFlags.push_back(tagged[i].first);
+            }
+            groups.back().push_back(std::move(tagged[i].second));
+        }
+    }
+
+    int CellCoordinate(float value, float origin, float tileSize, int dim) {
+        int cell = static_cast<int>(std::floor((value - origin) / tileSize));
+        return std::min(std::max(cell, 0), dim - 1);
+    }
+}
+
+TiledScene::TiledScene()
+    : tileSize(0.0f), memoryBudget(DEFAULT_MEMORY_BUDGET), residentBytes(0), residentTiles(0), tileLoads(0) {
+    dims[0] = dims[1] = 0;
+}
+
+bool TiledScene::Create(const std::string& path, const std::vector<std::vector<TriangleCombined>>& meshes,
+    const std::vector<std::vector<HullCombined>>& hullSets, float tileSize, const std::vector<uint32_t>& meshFlags) {
+    if (!(tileSize > 0.0f)) {
+        DEBUG_LOG_ERROR("[TiledScene] Tile size must be positive");
+        return false;
+    }
+    if (!meshFlags.empty() && meshFlags.size() != meshes.size() + hullSets.size()) {
+        DEBUG_LOG_ERROR("[TiledScene] Got flags for " << meshFlags.size() << " meshes, geometry has " << meshes.size() + hullSets.size());
+        return false;
+    }
+    auto flagsOf = [&](size_t mesh) { return meshFlags.empty() ? 0u : meshFlags[mesh]; };
+
+    AABB world = EmptyBounds();
+    size_t primitiveCount = 0;
+    for (const auto& mesh : meshes) {
+        for (const auto& tri : mesh) {
+            Extend(world, tri.ComputeAABB());
+        }
+        primitiveCount += mesh.size();
+    }
+    for (const auto& hullSet : hullSets) {
+        for (const auto& hull : hullSet) {
+            if (!hull.planes.empty()) {
+                Extend(world, hull.bounds);
+                ++primitiveCount;
+            }
+        }
+    }
+    if (primitiveCount == 0) {
+        DEBUG_LOG_ERROR("[TiledScene] No triangles or hulls to tile");
+        return false;
+    }
+    Inflate(world);
+
+    // Tile bounds are inflated by at most as much, so they stay inside the grid
+    const Vec3 origin = world.min;
+    const float extent = std::max(world.max.x - world.min.x, world.max.y - world.min.y);
+    if (extent / tileSize > MAX_TILES_PER_AXIS) {
+        tileSize = extent / MAX_TILES_PER_AXIS;
+        DEBUG_LOG_WARNING("[TiledScene] Tile size enlarged to " << tileSize << " to stay within " << MAX_TILES_PER_AXIS << " tiles per axis");
+    }
+    int dims[2] = {
+        std::min(std::max(1, static_cast<int>(std::ceil((world.max.x - origin.x) / tileSize))), MAX_TILES_PER_AXIS),
+        std::min(std::max(1, static_cast<int>(std::ceil((world.max.y - origin.y) / tileSize))), MAX_TILES_PER_AXIS)
+    };
+
+    // Each primitive belongs to the tile holding the center of its bounds
+    const size_t cellCount = static_cast<size_t>(dims[0]) * dims[1];
+    std::vector<std::vector<std::pair<uint32_t, TriangleCombined>>> cellTriangles(cellCount);
+    std::vector<std::vector<std::pair<uint32_t, HullCombined>>> cellHulls(cellCount);
+    auto cellOf = [&](const AABB& bounds) {
+        int x = CellCoordinate((bounds.min.x + bounds.max.x) * 0.5f, origin.x, tileSize, dims[0]);
+        int y = CellCoordinate((bounds.min.y + bounds.max.y) * 0.5f, origin.y, tileSize, dims[1]);
+        return static_cast<size_t>(y) * dims[0] + x;
+    };
+    for (size_t m = 0; m < meshes.size(); ++m) {
+        for (const auto& tri : meshes[m]) {
+            cellTriangles[cellOf(tri.ComputeAABB())].emplace_back(flagsOf(m), tri);
+        }
+    }
+    for (size_t s = 0; s < hullSets.size(); ++s) {
+        for (const auto& hull : hullSets[s]) {
+            if (!hull.planes.empty()) {
+                cellHulls[cellOf(hull.bounds)].emplace_back(flagsOf(meshes.size() + s), hull);
+            }
+        }
+    }
+
+    try {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) {
+            DEBUG_LOG_ERROR("[TiledScene] Failed to create tiled file: " << path);
+            return false;
+        }
+
+        std::vector<size_t> occupied;
+        for (size_t c = 0; c < cellCount; ++c) {
+            if (!cellTriangles[c].empty() || !cellHulls[c].empty()) {
+                occupied.push_back(c);
+            }
+        }
+
+        TiledHeader header = {};
+        header.magic = TILED_MAGIC;
+        header.version = TILED_VERSION;
+        header.tileSize = tileSize;
+        header.dims[0] = dims[0];
+        header.dims[1] = dims[1];
+        header.origin = origin;
+        header.tileCount = occupied.size();
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        // Records are written once the tile offsets are known
+        std::vector<TileRecord> records(occupied.size());
+        const uint64_t recordOffset = sizeof(header);
+        out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(TileRecord));
+        uint64_t offset = recordOffset + records.size() * sizeof(TileRecord);
+
+        DEBUG_LOG_INFO("[TiledScene] Writing " << occupied.size() << " tiles of " << tileSize << " units (" << dims[0] << "x" << dims[1] << " grid)");
+
+        for (size_t i = 0; i < occupied.size(); ++i) {
+            const size_t c = occupied[i];
+            AABB bounds = EmptyBounds();
+            for (const auto& tagged : cellTriangles[c]) {
+                Extend(bounds, tagged.second.ComputeAABB());
+            }
+            for (const auto& tagged : cellHulls[c]) {
+                Extend(bounds, tagged.second.bounds);
+            }
+            Inflate(bounds);
+
+            // Tile meshes come first in the tile scene, then its hull sets
+            std::vector<std::vector<TriangleCombined>> tileMeshes;
+            std::vector<std::vector<HullCombined>> tileHulls;
+            std::vector<uint32_t> tileFlags;
+            GroupByFlags(cellTriangles[c], tileMeshes, tileFlags);
+            GroupByFlags(cellHulls[c], tileHulls, tileFlags);
+            std::vector<std::pair<uint32_t, TriangleCombined>>().swap(cellTriangles[c]);
+            std::vector<std::pair<uint32_t, HullCombined>>().swap(cellHulls[c]);
+
+            auto tile = VisScene::Build(tileMeshes, tileHulls);
+            if (tile && std::any_of(tileFlags.begin(), tileFlags.end(), [](uint32_t flags) { return flags != 0; })) {
+                tile = tile->WithMeshFlags(tileFlags, VisSceneOptions());
+            }
+            if (!tile) {
+                DEBUG_LOG_ERROR("[TiledScene] Failed to build tile " << i);
+                return false;
+            }
+
+            uint64_t padding = (TILE_ALIGNMENT - offset % TILE_ALIGNMENT) % TILE_ALIGNMENT;
+            const char zeros[TILE_ALIGNMENT] = {};
+            out.write(zeros, static_cast<std::streamsize>(padding));
+            offset += padding;
+
+            records[i].bounds = bounds;
+            records[i].offset = offset;
+            records[i].size = tile->GetMemoryUsage();
+            out.write(reinterpret_cast<const char*>(tile->GetData()), static_cast<std::streamsize>(records[i].size));
+            offset += records[i].size;
+        }
+
+        out.seekp(static_cast<std::streamoff>(recordOffset));
+        out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(TileRecord));
+        out.close();
+        return static_cast<bool>(out);
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[TiledScene] Exception writing tiled file: " << e.what());
+        return false;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[TiledScene] Unknown exception writing tiled file");
+        return false;
+    }
+}
+
+std::shared_ptr<TiledScene> TiledScene::Open(const std::string& path, size_t memoryBudget) {
+    try {
+        std::shared_ptr<TiledScene> scene(new TiledScene());
+        scene->file.open(path, std::ios::binary);
+        if (!scene->file) {
+            DEBUG_LOG_ERROR("[TiledScene] Failed to open tiled file: " << path);
+            return nullptr;
+        }
+
+        scene->file.seekg(0, std::ios::end);
+        const uint64_t fileSize = static_cast<uint64_t>(scene->file.tellg());
+        scene->file.seekg(0, std::ios::beg);
+
+        TiledHeader header;
+        scene->file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!scene->file || header.magic != TILED_MAGIC || header.version != TILED_VERSION) {
+            DEBUG_LOG_ERROR("[TiledScene] Not a tiled file or unsupported version: " << path);
+            return nullptr;
+        }
+        if (!(header.tileSize > 0.0f) || !std::isfinite(header.tileSize)
+            || !std::isfinite(header.origin.x) || !std::isfinite(header.origin.y) || !std::isfinite(header.origin.z)
+            || header.dims[0] <= 0 || header.dims[1] <= 0
+            || header.dims[0] > MAX_TILES_PER_AXIS || header.dims[1] > MAX_TILES_PER_AXIS
+            || header.tileCount > static_cast<uint64_t>(header.dims[0]) * header.dims[1]) {
+            DEBUG_LOG_ERROR("[TiledScene] Invalid tile grid in: " << path);
+            return nullptr;
+        }
+
+        std::vector<TileRecord> records(static_cast<size_t>(header.tileCount));
+        scene->file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(TileRecord));
+        if (!scene->file) {
+            DEBUG_LOG_ERROR("[TiledScene] Truncated tile index in: " << path);
+            return nullptr;
+        }
+
+        scene->tileSize = header.tileSize;
+        scene->dims[0] = header.dims[0];
+        scene->dims[1] = header.dims[1];
+        scene->origin = header.origin;
+        scene->memoryBudget = memoryBudget;
+        scene->cellTiles.resize(static_cast<size_t>(header.dims[0]) * header.dims[1]);
+        scene->tiles.resize(records.size());
+
+        for (size_t i = 0; i < records.size(); ++i) {
+            const TileRecord& record = records[i];
+            if (record.offset > fileSize || record.size > fileSize - record.offset) {
+                DEBUG_LOG_ERROR("[TiledScene] Tile " << i << " lies outside the file: " << path);
+                return nullptr;
+            }
+            const Vec3& lo = record.bounds.min;
+            const Vec3& hi = record.bounds.max;
+            if (!std::isfinite(lo.x) || !std::isfinite(lo.y) || !std::isfinite(lo.z)
+                || !std::isfinite(hi.x) || !std::isfinite(hi.y) || !std::isfinite(hi.z)
+                || lo.x > hi.x || lo.y > hi.y || lo.z > hi.z) {
+                DEBUG_LOG_ERROR("[TiledScene] Tile " << i << " has invalid bounds: " << path);
+                return nullptr;
+            }
+
+            Tile& tile = scene->tiles[i];
+            tile.bounds = record.bounds;
+            tile.offset = record.offset;
+            tile.size = record.size;
+
+            int x0 = CellCoordinate(record.bounds.min.x, header.origin.x, header.tileSize, header.dims[0]);
+            int x1 = CellCoordinate(record.bounds.max.x, header.origin.x, header.tileSize, header.dims[0]);
+            int y0 = CellCoordinate(record.bounds.min.y, header.origin.y, header.tileSize, header.dims[1]);
+            int y1 = CellCoordinate(record.bounds.max.y, header.origin.y, header.tileSize, header.dims[1]);
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    scene->cellTiles[static_cast<size_t>(y) * header.dims[0] + x].push_back(static_cast<uint32_t>(i));
+                }
+            }
+        }
+
+        DEBUG_LOG_INFO("[TiledScene] Opened " << records.size() << " tiles, memory budget " << memoryBudget << " bytes");
+        return scene;
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[TiledScene] Exception opening tiled file: " << e.what());
+        return nullptr;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[TiledScene] Unknown exception opening tiled file");
+        return nullptr;
+    }
+}
+
+// 2D DDA over the tile grid, nearest cells first so blocked segments usually
+// stop after the first tiles they load
+void TiledScene::CollectTiles(const Vec3& point1, const Vec3& point2, std::vector<uint32_t>& out) const {
+    const Vec3 delta(point2.x - point1.x, point2.y - point1.y, point2.z - point1.z);
+    AABB gridBounds;
+    gridBounds.min = Vec3(origin.x, origin.y, std::numeric_limits<float>::lowest());
+    gridBounds.max = Vec3(origin.x + dims[0] * tileSize, origin.y + dims[1] * tileSize, std::numeric_limits<float>::max());
+
+    float tStart = 0.0f;
+    float tEnd = 1.0f;
+    if (!ClipSegment(gridBounds, point1, delta, tStart, tEnd)) {
+        return;
+    }
+
+    const float startX = point1.x + delta.x * tStart;
+    const float startY = point1.y + delta.y * tStart;
+    int cell[2] = {
+        CellCoordinate(startX, origin.x, tileSize, dims[0]),
+        CellCoordinate(startY, origin.y, tileSize, dims[1])
+    };
+    const float d[2] = { delta.x, delta.y };
+    const float o[2] = { origin.x, origin.y };
+    const float p[2] = { point1.x, point1.y };
+
+    int step[2];
+    float tMax[2];
+    float tDelta[2];
+    for (int i = 0; i < 2; ++i) {
+        if (d[i] > 0.0f) {
+            step[i] = 1;
+            tMax[i] = (o[i] + (cell[i] + 1) * tileSize - p[i]) / d[i];
+            tDelta[i] = tileSize / d[i];
+        } else if (d[i] < 0.0f) {
+            step[i] = -1;
+            tMax[i] = (o[i] + cell[i] * tileSize - p[i]) / d[i];
+            tDelta[i] = -tileSize / d[i];
+        } else {
+            step[i] = 0;
+            tMax[i] = std::numeric_limits<float>::max();
+            tDelta[i] = std::numeric_limits<float>::max();
+        }
+    }
+
+    // A tile covers a rectangle of cells and the walk is a straight line, so
+    // the cells a tile overlaps are visited one after another; checking the
+    // previous cell's list, which is sorted, is enough to skip repeats. A
+    // repeat slipping through on rounding only costs a second test.
+    const std::vector<uint32_t>* previous = nullptr;
+    while (true) {
+        const std::vector<uint32_t>& current = cellTiles[static_cast<size_t>(cell[1]) * dims[0] + cell[0]];
+        for (uint32_t index : current) {
+            if (previous && std::binary_search(previous->begin(), previous->end(), index)) {
+                continue;
+            }
+            float t0 = 0.0f;
+            float t1 = 1.0f;
+            if (ClipSegment(tiles[index].bounds, point1, delta, t0, t1)) {
+                out.push_back(index);
+            }
+        }
+        previous = &current;
+
+        int axis = tMax[0] < tMax[1] ? 0 : 1;
+        if (tMax[axis] > tEnd) {
+            break;
+        }
+        cell[axis] += step[axis];
+        tMax[axis] += tDelta[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {
+            break;
+        }
+    }
+}
+
+std::shared_ptr<const VisScene> TiledScene::AcquireTile(uint32_t index) {
+    Tile& tile = tiles[index];
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (tile.scene) {
+            lru.splice(lru.begin(), lru, tile.lruPosition);
+            return tile.scene;
+        }
+    }
+
+    // Read and validate without holding the cache lock so queries on resident
+    // tiles are not stalled behind disk I/O
+    std::vector<unsigned char> data(static_cast<size_t>(tile.size));
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(tile.offset));
+        file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!file) {
+            DEBUG_LOG_ERROR("[TiledScene] Failed to read tile " << index);
+            file.clear();
+            return nullptr;
+        }
+    }
+
+    auto scene = VisScene::FromData(std::move(data));
+    if (!scene) {
+        DEBUG_LOG_ERROR("[TiledScene] Tile " << index << " is corrupt");
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (tile.scene) {
+        // Another thread loaded the tile meanwhile; keep its copy
+        lru.splice(lru.begin(), lru, tile.lruPosition);
+        return tile.scene;
+    }
+    tile.scene = scene;
+    lru.push_front(index);
+    tile.lruPosition = lru.begin();
+    residentBytes += static_cast<size_t>(tile.size);
+    ++residentTiles;
+    ++tileLoads;
+
+    EvictOverBudget(index);
+    return scene;
+}
+
+// Tiles still referenced by running queries stay alive until those finish
+void TiledScene::EvictOverBudget(uint32_t keep) {
+    while (residentBytes > memoryBudget && !lru.empty() && lru.back() != keep) {
+        Tile& victim = tiles[lru.back()];
+        lru.pop_back();
+        victim.scene.reset();
+        residentBytes -= static_cast<size_t>(victim.size);
+        --residentTiles;
+    }
+}
+
+bool TiledScene::IsVisible(const Vec3& point1, const Vec3& point2, uint32_t ignoreFlags) {
+    const float dx = point2.x - point1.x;
+    const float dy = point2.y - point1.y;
+    const float dz = point2.z - point1.z;
+    if (std::sqrt(dx * dx + dy * dy + dz * dz) < 0.001f) {
+        return true;
+    }
+
+    // Reused across queries on this thread to keep the hot path allocation free
+    static thread_local std::vector<uint32_t> candidates;
+    candidates.clear();
+    CollectTiles(point1, point2, candidates);
+
+    for (uint32_t index : candidates) {
+        auto tile = AcquireTile(index);
+        if (!tile) {
+            // Without the tile the answer would not be exact; report blocked
+            // like a query against missing geometry
+            return false;
+        }
+        if (!tile->IsVisible(point1, point2, ignoreFlags)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TiledScene::SetMemoryBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    memoryBudget = bytes;
+    EvictOverBudget(lru.empty() ? 0xFFFFFFFFu : lru.front());
+}
+
+size_t TiledScene::GetResidentTileCount() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return residentTiles;
+}
+
+size_t TiledScene::GetResidentBytes() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return residentBytes;
+}
+
+size_t TiledScene::GetTileLoadCount() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return tileLoads;
+}
@@ -1,4 +1,5 @@
 #include "VisCheck.h"
+#include "OptimizedGeometry.h"
 #include "Debug.h"
 #include <cmath>
 #include <algorithm>
@@ -7,264 +8,171 @@
 #include <cstring>
 #include <cctype>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <system_error>
+#include <chrono>
 
-namespace Vec3Helpers {
-    inline Vec3 Subtract(const Vec3& a, const Vec3& b) {
-        return Vec3(a.x - b.x, a.y - b.y, a.z - b.z);
-    }
+namespace {
+    const uint32_t QUERY_FILE_VERSION = 1;
     
-    inline float Dot(const Vec3& a, const Vec3& b) {
-        return a.x * b.x + a.y * b.y + a.z * b.z;
-    }
+    // Below this many pairs a matrix is traced on the calling thread
+    const size_t MIN_PAIRS_PER_THREAD = 256;
     
-    inline Vec3 Cross(const Vec3& a, const Vec3& b) {
-        return Vec3(
-            a.y * b.z - a.z * b.y,
-            a.z * b.x - a.x * b.z,
-            a.x * b.y - a.y * b.x
-        );
-    }
+    const size_t DEFAULT_BATCH_SORT_THRESHOLD = 4096;
     
-    inline float LengthSquared(const Vec3& v) {
-        return v.x * v.x + v.y * v.y + v.z * v.z;
-    }
-}
-
-bool AABB::RayIntersects(const Vec3& rayOrigin, const Vec3& rayDir) const {
-    float tmin = std::numeric_limits<float>::lowest();
-    float tmax = std::numeric_limits<float>::max();
-
-    const float* rayOriginArr = &rayOrigin.x;
-    const float* rayDirArr = &rayDir.x;
-    const float* minArr = &min.x;
-    const float* maxArr = &max.x;
-
-    for (int i = 0; i < 3; ++i) {
-        float invDir = 1.0f / rayDirArr[i];
-        float t0 = (minArr[i] - rayOriginArr[i]) * invDir;
-        float t1 = (maxArr[i] - rayOriginArr[i]) * invDir;
-
-        if (invDir < 0.0f) std::swap(t0, t1);
-        tmin = std::max(tmin, t0);
-        tmax = std::min(tmax, t1);
+    // Samples in the first round of a target query; later rounds use full
+    // packets. A small first round settles clear cases with few rays.
+    const size_t FIRST_TARGET_ROUND = 8;
+    const int MAX_SAMPLES_PER_AXIS = 8;
+    
+    inline uint32_t CountBits(uint32_t v) {
+        v = v - ((v >> 1) & 0x55555555);
+        v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+        return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
     }
-
-    return tmax >= tmin && tmax >= 0;
-}
-
-AABB TriangleCombined::ComputeAABB() const {
-    Vec3 min_point, max_point;
-
-    min_point.x = std::min({ v0.x, v1.x, v2.x });
-    min_point.y = std::min({ v0.y, v1.y, v2.y });
-    min_point.z = std::min({ v0.z, v1.z, v2.z });
-
-    max_point.x = std::max({ v0.x, v1.x, v2.x });
-    max_point.y = std::max({ v0.y, v1.y, v2.y });
-    max_point.z = std::max({ v0.z, v1.z, v2.z });
-
-    return { min_point, max_point };
-}
-
-VisCheck::VisCheck() : geometryLoaded(false) {
-}
-
-VisCheck::~VisCheck() {
-}
-
-std::unique_ptr<BVHNode> VisCheck::BuildBVH(const std::vector<TriangleCombined>& tris) {
-    auto node = std::make_unique<BVHNode>();
-
-    if (tris.empty()) return node;
     
-    AABB bounds = tris[0].ComputeAABB();
-    for (size_t i = 1; i < tris.size(); ++i) {
-        AABB triAABB = tris[i].ComputeAABB();
-        bounds.min.x = std::min(bounds.min.x, triAABB.min.x);
-        bounds.min.y = std::min(bounds.min.y, triAABB.min.y);
-        bounds.min.z = std::min(bounds.min.z, triAABB.min.z);
-        bounds.max.x = std::max(bounds.max.x, triAABB.max.x);
-        bounds.max.y = std::max(bounds.max.y, triAABB.max.y);
-        bounds.max.z = std::max(bounds.max.z, triAABB.max.z);
+    inline uint32_t ReverseBits(uint32_t v) {
+        v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+        v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+        v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+        return (v >> 16) | (v << 16);
     }
-    node->bounds = bounds;
     
-    if (tris.size() <= LEAF_THRESHOLD) {
-        node->triangles = tris;
-        return node;
+    inline uint32_t SpreadBits(uint32_t v) {
+        v &= 0x3FF;
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v << 8)) & 0x0300F00F;
+        v = (v | (v << 4)) & 0x030C30C3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
     }
     
-    Vec3 diff = Vec3Helpers::Subtract(bounds.max, bounds.min);
-    int axis = (diff.x > diff.y && diff.x > diff.z) ? 0 : ((diff.y > diff.z) ? 1 : 2);
+    // 30-bit Morton code of a point inside bounds
+    uint32_t MortonCode(const Vec3& p, const Vec3& lo, const Vec3& scale) {
+        auto quantize = [](float v) {
+            return static_cast<uint32_t>(std::min(std::max(v, 0.0f), 1023.0f));
+        };
+        return SpreadBits(quantize((p.x - lo.x) * scale.x))
+            | (SpreadBits(quantize((p.y - lo.y) * scale.y)) << 1)
+            | (SpreadBits(quantize((p.z - lo.z) * scale.z)) << 2);
+    }
     
-    std::vector<TriangleCombined> sortedTris = tris;
-    std::sort(sortedTris.begin(), sortedTris.end(), [axis](const TriangleCombined& a, const TriangleCombined& b) {
-        AABB aabbA = a.ComputeAABB();
-        AABB aabbB = b.ComputeAABB();
-        float centerA, centerB;
-        if (axis == 0) {
-            centerA = (aabbA.min.x + aabbA.max.x) / 2.0f;
-            centerB = (aabbB.min.x + aabbB.max.x) / 2.0f;
+    // Cube map cell of a direction: face, then 8-bit coordinates on the face,
+    // so neighboring keys point in similar directions
+    uint32_t DirectionKey(const Vec3& d) {
+        const float ax = std::fabs(d.x);
+        const float ay = std::fabs(d.y);
+        const float az = std::fabs(d.z);
+        uint32_t face;
+        float u;
+        float v;
+        float major;
+        if (ax >= ay && ax >= az) {
+            face = d.x >= 0.0f ? 0 : 1;
+            u = d.y;
+            v = d.z;
+            major = ax;
+        } else if (ay >= az) {
+            face = d.y >= 0.0f ? 2 : 3;
+            u = d.x;
+            v = d.z;
+            major = ay;
+        } else {
+            face = d.z >= 0.0f ? 4 : 5;
+            u = d.x;
+            v = d.y;
+            major = az;
         }
-        else if (axis == 1) {
-            centerA = (aabbA.min.y + aabbA.max.y) / 2.0f;
-            centerB = (aabbB.min.y + aabbB.max.y) / 2.0f;
+        if (major == 0.0f) {
+            return 0;
         }
-        else {
-            centerA = (aabbA.min.z + aabbA.max.z) / 2.0f;
-            centerB = (aabbB.min.z + aabbB.max.z) / 2.0f;
-        }
-        return centerA < centerB;
-    });
-
-    size_t mid = sortedTris.size() / 2;
-    std::vector<TriangleCombined> leftTris(sortedTris.begin(), sortedTris.begin() + mid);
-    std::vector<TriangleCombined> rightTris(sortedTris.begin() + mid, sortedTris.end());
-
-    node->left = BuildBVH(leftTris);
-    node->right = BuildBVH(rightTris);
-
-    return node;
-}
-
-bool VisCheck::IntersectBVH(const BVHNode* node, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance, float& hitDistance) const {
-    if (!node->bounds.RayIntersects(rayOrigin, rayDir)) {
-        return false;
+        auto quantize = [major](float c) {
+            return static_cast<uint32_t>(std::min(std::max((c / major + 1.0f) * 127.5f, 0.0f), 255.0f));
+        };
+        return (face << 16) | (quantize(u) << 8) | quantize(v);
     }
-
-    bool hit = false;
-    if (node->IsLeaf()) {
-        for (const auto& tri : node->triangles) {
-            float t;
-            if (RayIntersectsTriangle(rayOrigin, rayDir, tri, t)) {
-                if (t < maxDistance && t < hitDistance) {
-                    hitDistance = t;
-                    hit = true;
-                }
+    
+    // LSD radix sort of (key, index) pairs on 8-bit digits. Stable, so equal
+    // keys keep call order.
+    void RadixSort(std::vector<std::pair<uint32_t, uint32_t>>& items, std::vector<std::pair<uint32_t, uint32_t>>& scratch) {
+        scratch.resize(items.size());
+        for (int shift = 0; shift < 32; shift += 8) {
+            size_t offsets[257] = {};
+            for (const auto& item : items) {
+                ++offsets[((item.first >> shift) & 0xFF) + 1];
             }
-        }
-    } else {
-        if (node->left) {
-            hit |= IntersectBVH(node->left.get(), rayOrigin, rayDir, maxDistance, hitDistance);
-        }
-        if (node->right) {
-            hit |= IntersectBVH(node->right.get(), rayOrigin, rayDir, maxDistance, hitDistance);
+            // Skip digits every key shares
+            if (items.empty() || offsets[((items[0].first >> shift) & 0xFF) + 1] == items.size()) {
+                continue;
+            }
+            for (int i = 0; i < 256; ++i) {
+                offsets[i + 1] += offsets[i];
+            }
+            for (const auto& item : items) {
+                scratch[offsets[(item.first >> shift) & 0xFF]++] = item;
+            }
+            items.swap(scratch);
         }
     }
-    return hit;
 }
 
-bool VisCheck::RayIntersectsTriangle(const Vec3& rayOrigin, const Vec3& rayDir,
-    const TriangleCombined& triangle, float& t) const {
-    const float EPSILON = 1e-7f;
-
-    Vec3 edge1 = Vec3Helpers::Subtract(triangle.v1, triangle.v0);
-    Vec3 edge2 = Vec3Helpers::Subtract(triangle.v2, triangle.v0);
-    Vec3 h = Vec3Helpers::Cross(rayDir, edge2);
-    float a = Vec3Helpers::Dot(edge1, h);
-
-    if (a > -EPSILON && a < EPSILON)
-        return false;
-
-    float f = 1.0f / a;
-    Vec3 s = Vec3Helpers::Subtract(rayOrigin, triangle.v0);
-    float u = f * Vec3Helpers::Dot(s, h);
-
-    if (u < 0.0f || u > 1.0f)
-        return false;
-
-    Vec3 q = Vec3Helpers::Cross(s, edge1);
-    float v = f * Vec3Helpers::Dot(rayDir, q);
-
-    if (v < 0.0f || u + v > 1.0f)
-        return false;
+VisCheck::VisCheck()
+    : recordingQueries(false), maxRecordedQueries(0), queriesSeen(0),
+    batchSortThreshold(DEFAULT_BATCH_SORT_THRESHOLD) {
+}
 
-    t = f * Vec3Helpers::Dot(edge2, q);
+VisCheck::VisCheck(std::shared_ptr<const VisScene> sharedScene)
+    : scene(std::move(sharedScene)), recordingQueries(false), maxRecordedQueries(0), queriesSeen(0),
+    batchSortThreshold(DEFAULT_BATCH_SORT_THRESHOLD) {
+}
 
-    return (t > EPSILON);
+VisCheck::~VisCheck() {
 }
 
 bool VisCheck::LoadGeometry(const std::vector<std::vector<TriangleCombined>>& geometryMeshes) {
-    if (geometryMeshes.empty()) {
+    return LoadGeometry(geometryMeshes, std::vector<std::vector<HullCombined>>());
+}
+
+bool VisCheck::LoadGeometry(const std::vector<std::vector<TriangleCombined>>& geometryMeshes,
+    const std::vector<std::vector<HullCombined>>& hullSets) {
+    if (geometryMeshes.empty() && hullSets.empty()) {
         DEBUG_LOG_ERROR("[VisCheck] No geometry meshes provided");
         return false;
     }
     
-    meshes = geometryMeshes;
-    bvhNodes.clear();
+    scene = VisScene::Build(geometryMeshes, hullSets, sceneOptions);
+    tiledScene.reset();
     
-    for (size_t i = 0; i < meshes.size(); ++i) {
-        if (meshes[i].empty()) {
-            DEBUG_LOG_WARNING("[VisCheck] Mesh " << i << " is empty, skipping");
-            continue;
-        }
-        
-        DEBUG_LOG_INFO("[VisCheck] Building BVH for mesh " << i << " with " << meshes[i].size() << " triangles...");
-        bvhNodes.push_back(BuildBVH(meshes[i]));
+    if (scene) {
+        DEBUG_LOG_INFO("[VisCheck] Successfully loaded geometry with " << scene->GetMeshCount() << " meshes, " << scene->GetTriangleCount() << " triangles and " << scene->GetHullCount() << " hulls");
     }
     
-    geometryLoaded = (meshes.size() > 0 && bvhNodes.size() > 0);
-    
-    if (geometryLoaded) {
-        DEBUG_LOG_INFO("[VisCheck] Successfully loaded geometry with " << meshes.size() << " meshes and " << bvhNodes.size() << " BVH trees");
-    }
-    
-    return geometryLoaded;
+    return scene != nullptr;
 }
 
 bool VisCheck::LoadFromOptFile(const std::string& filePath) {
     try {
-        std::ifstream in(filePath, std::ios::binary);
-        if (!in) {
+        OptimizedGeometry geometry;
+        if (!geometry.LoadFromFile(filePath)) {
             DEBUG_LOG_ERROR("[VisCheck] Failed to open file: " << filePath);
             return false;
         }
         
-        meshes.clear();
-        bvhNodes.clear();
+        scene.reset();
+        tiledScene.reset();
         
-        size_t numMeshes;
-        in.read(reinterpret_cast<char*>(&numMeshes), sizeof(size_t));
+        DEBUG_LOG_INFO("[VisCheck] Loading " << geometry.meshes.size() << " meshes from file...");
         
-        if (numMeshes == 0) {
-            DEBUG_LOG_WARNING("[VisCheck] File has 0 meshes");
-            in.close();
+        // Empty meshes keep their slots so scene mesh indices match the file
+        bool hasTriangles = std::any_of(geometry.meshes.begin(), geometry.meshes.end(),
+            [](const std::vector<TriangleCombined>& mesh) { return !mesh.empty(); });
+        if (!hasTriangles && geometry.hulls.empty()) {
+            DEBUG_LOG_WARNING("[VisCheck] File has no triangles or hulls");
             return false;
         }
-        
-        DEBUG_LOG_INFO("[VisCheck] Loading " << numMeshes << " meshes from file...");
-        
-        for (size_t i = 0; i < numMeshes; ++i) {
-            size_t numTris;
-            in.read(reinterpret_cast<char*>(&numTris), sizeof(size_t));
-            
-            if (numTris == 0) {
-                DEBUG_LOG_WARNING("[VisCheck] Mesh " << i << " has 0 triangles, skipping");
-                continue;
-            }
-            
-            std::vector<TriangleCombined> mesh;
-            mesh.resize(numTris);
-            
-            for (size_t j = 0; j < numTris; ++j) {
-                in.read(reinterpret_cast<char*>(&mesh[j].v0), sizeof(Vec3));
-                in.read(reinterpret_cast<char*>(&mesh[j].v1), sizeof(Vec3));
-                in.read(reinterpret_cast<char*>(&mesh[j].v2), sizeof(Vec3));
-            }
-            
-            meshes.push_back(mesh);
-            DEBUG_LOG_INFO("[VisCheck] Building BVH for mesh " << i << " with " << numTris << " triangles...");
-            bvhNodes.push_back(BuildBVH(mesh));
-        }
-        
-        in.close();
-        geometryLoaded = (meshes.size() > 0 && bvhNodes.size() > 0);
-        
-        if (geometryLoaded) {
-            DEBUG_LOG_INFO("[VisCheck] Successfully loaded geometry with " << meshes.size() << " meshes and " << bvhNodes.size() << " BVH trees");
-        }
-        
-        return geometryLoaded;
+        return LoadGeometry(geometry.meshes, geometry.hulls);
     } catch (const std::exception& e) {
         DEBUG_LOG_ERROR("[VisCheck] Exception loading file: " << e.what());
         return false;
@@ -278,192 +186,517 @@ bool VisCheck::LoadOptFile(const std::string& filePath) {
     return LoadFromOptFile(filePath);
 }
 
-void VisCheck::SerializeBVHNode(std::ofstream& out, const BVHNode* node) {
-    if (!node) {
-        bool isNull = true;
-        out.write(reinterpret_cast<const char*>(&isNull), sizeof(bool));
-        return;
+bool VisCheck::SaveBVHToFile(const std::string& cachePath) {
+    if (!scene) {
+        DEBUG_LOG_ERROR("[VisCheck] No geometry loaded, nothing to cache");
+        return false;
     }
-    
-    bool isNull = false;
-    out.write(reinterpret_cast<const char*>(&isNull), sizeof(bool));
-    
-    out.write(reinterpret_cast<const char*>(&node->bounds.min), sizeof(Vec3));
-    out.write(reinterpret_cast<const char*>(&node->bounds.max), sizeof(Vec3));
-    
-    bool isLeaf = node->IsLeaf();
-    out.write(reinterpret_cast<const char*>(&isLeaf), sizeof(bool));
-    
-    if (isLeaf) {
-        size_t numTris = node->triangles.size();
-        out.write(reinterpret_cast<const char*>(&numTris), sizeof(size_t));
-        for (const auto& tri : node->triangles) {
-            out.write(reinterpret_cast<const char*>(&tri.v0), sizeof(Vec3));
-            out.write(reinterpret_cast<const char*>(&tri.v1), sizeof(Vec3));
-            out.write(reinterpret_cast<const char*>(&tri.v2), sizeof(Vec3));
-        }
-    } else {
-        SerializeBVHNode(out, node->left.get());
-        SerializeBVHNode(out, node->right.get());
+    return scene->SaveBVHCache(cachePath);
+}
+
+// The cache holds the full BVH including triangles, so it can be loaded on its
+// own. If geometry is already loaded the cache must describe the same meshes.
+bool VisCheck::LoadBVHFromFile(const std::string& cachePath) {
+    auto loaded = VisScene::LoadBVHCache(cachePath, sceneOptions);
+    if (!loaded) {
+        return false;
     }
+    if (scene && loaded->GetMeshCount() != scene->GetMeshCount()) {
+        DEBUG_LOG_WARNING("[VisCheck] BVH cache has " << loaded->GetMeshCount() << " meshes, loaded geometry has " << scene->GetMeshCount());
+        return false;
+    }
+    scene = std::move(loaded);
+    tiledScene.reset();
+    return true;
 }
 
-std::unique_ptr<BVHNode> VisCheck::DeserializeBVHNode(std::ifstream& in) {
-    bool isNull;
-    in.read(reinterpret_cast<char*>(&isNull), sizeof(bool));
-    
-    if (isNull) {
-        return nullptr;
+bool VisCheck::SaveTiledFile(const std::string& path, float tileSize) {
+    if (!scene) {
+        DEBUG_LOG_ERROR("[VisCheck] No geometry loaded, nothing to tile");
+        return false;
     }
     
-    auto node = std::make_unique<BVHNode>();
-    
-    in.read(reinterpret_cast<char*>(&node->bounds.min), sizeof(Vec3));
-    in.read(reinterpret_cast<char*>(&node->bounds.max), sizeof(Vec3));
-    
-    bool isLeaf;
-    in.read(reinterpret_cast<char*>(&isLeaf), sizeof(bool));
-    
-    if (isLeaf) {
-        size_t numTris;
-        in.read(reinterpret_cast<char*>(&numTris), sizeof(size_t));
-        node->triangles.resize(numTris);
-        for (size_t i = 0; i < numTris; ++i) {
-            in.read(reinterpret_cast<char*>(&node->triangles[i].v0), sizeof(Vec3));
-            in.read(reinterpret_cast<char*>(&node->triangles[i].v1), sizeof(Vec3));
-            in.read(reinterpret_cast<char*>(&node->triangles[i].v2), sizeof(Vec3));
+    // Same order as the extracted geometry: triangle meshes, then hull sets
+    std::vector<uint32_t> meshFlags;
+    for (int pass = 0; pass < 2; ++pass) {
+        const uint32_t type = pass == 0 ? SceneMesh::Triangles : SceneMesh::Hulls;
+        for (size_t i = 0; i < scene->GetMeshCount(); ++i) {
+            if (scene->GetMesh(i).primitiveType == type) {
+                meshFlags.push_back(scene->GetMesh(i).flags);
+            }
         }
-    } else {
-        node->left = DeserializeBVHNode(in);
-        node->right = DeserializeBVHNode(in);
     }
-    
-    return node;
+    return TiledScene::Create(path, scene->ExtractMeshes(), scene->ExtractHulls(), tileSize, meshFlags);
 }
 
-bool VisCheck::SaveBVHToFile(const std::string& cachePath) {
-    return SaveBVHCache(cachePath);
+bool VisCheck::LoadTiledFile(const std::string& path, size_t memoryBudget) {
+    auto tiles = TiledScene::Open(path, memoryBudget);
+    if (!tiles) {
+        return false;
+    }
+    tiledScene = std::move(tiles);
+    scene.reset();
+    return true;
+}
+
+void VisCheck::EnableOccupancyGrid(float cellSize) {
+    sceneOptions.occupancyCellSize = cellSize;
+    RebuildScene();
 }
 
-bool VisCheck::SaveBVHCache(const std::string& cachePath) {
+void VisCheck::DisableOccupancyGrid() {
+    sceneOptions.occupancyCellSize = 0.0f;
+    RebuildScene();
+}
+
+// Scenes are immutable; changing options rebuilds this handle's scene and
+// leaves other handles sharing the old one untouched
+void VisCheck::RebuildScene() {
+    if (!scene) {
+        return;
+    }
+    auto rebuilt = scene->WithOptions(sceneOptions);
+    if (rebuilt) {
+        scene = std::move(rebuilt);
+    }
+}
+
+void VisCheck::StartQueryRecording(size_t maxSamples) {
+    recordedQueries.clear();
+    recordedQueries.reserve(std::min<size_t>(maxSamples, 16384));
+    maxRecordedQueries = maxSamples;
+    queriesSeen = 0;
+    recordingQueries = maxSamples > 0;
+}
+
+// Reservoir sampling, so early and late queries are equally represented
+void VisCheck::RecordQuery(const Vec3& point1, const Vec3& point2) {
+    ++queriesSeen;
+    if (recordedQueries.size() < maxRecordedQueries) {
+        recordedQueries.push_back({ point1, point2 });
+        return;
+    }
+    uint64_t slot = std::uniform_int_distribution<uint64_t>(0, queriesSeen - 1)(recordRng);
+    if (slot < maxRecordedQueries) {
+        recordedQueries[static_cast<size_t>(slot)] = { point1, point2 };
+    }
+}
+
+bool VisCheck::SaveRecordedQueries(const std::string& path) const {
     try {
-        std::ofstream out(cachePath, std::ios::binary);
+        std::ofstream out(path, std::ios::binary);
         if (!out) {
-            DEBUG_LOG_ERROR("[VisCheck] Failed to create BVH cache file: " << cachePath);
+            DEBUG_LOG_ERROR("[VisCheck] Failed to create query file: " << path);
             return false;
         }
         
-        const uint32_t CACHE_VERSION = 1;
-        out.write(reinterpret_cast<const char*>(&CACHE_VERSION), sizeof(uint32_t));
-        
-        size_t numMeshes = meshes.size();
-        out.write(reinterpret_cast<const char*>(&numMeshes), sizeof(size_t));
-        
-        for (const auto& mesh : meshes) {
-            size_t numTris = mesh.size();
-            out.write(reinterpret_cast<const char*>(&numTris), sizeof(size_t));
-        }
-        
-        for (const auto& bvhRoot : bvhNodes) {
-            SerializeBVHNode(out, bvhRoot.get());
-        }
+        size_t numQueries = recordedQueries.size();
+        out.write(reinterpret_cast<const char*>(&QUERY_FILE_VERSION), sizeof(uint32_t));
+        out.write(reinterpret_cast<const char*>(&numQueries), sizeof(size_t));
+        out.write(reinterpret_cast<const char*>(recordedQueries.data()), numQueries * sizeof(QuerySegment));
         
         out.close();
-        return true;
+        return static_cast<bool>(out);
     } catch (const std::exception& e) {
-        DEBUG_LOG_ERROR("[VisCheck] Exception saving BVH cache: " << e.what());
+        DEBUG_LOG_ERROR("[VisCheck] Exception saving query file: " << e.what());
         return false;
     } catch (...) {
-        DEBUG_LOG_ERROR("[VisCheck] Unknown exception saving BVH cache");
+        DEBUG_LOG_ERROR("[VisCheck] Unknown exception saving query file");
         return false;
     }
 }
 
-// Optional: Load BVH cache from file (example implementation)
-bool VisCheck::LoadBVHFromFile(const std::string& cachePath) {
-    size_t meshCount = 0;
-    if (LoadBVHCache(cachePath, meshCount)) {
-        if (meshCount == meshes.size()) {
-            return true;
-        }
-    }
-    return false;
-}
-
-bool VisCheck::LoadBVHCache(const std::string& cachePath, size_t& meshCount) {
+bool VisCheck::LoadRecordedQueries(const std::string& path) {
     try {
-        std::ifstream in(cachePath, std::ios::binary);
+        std::ifstream in(path, std::ios::binary);
         if (!in) {
-            DEBUG_LOG_ERROR("[VisCheck] Failed to open BVH cache file: " << cachePath);
+            DEBUG_LOG_ERROR("[VisCheck] Failed to open query file: " << path);
             return false;
         }
         
-        uint32_t version;
+        uint32_t version = 0;
+        size_t numQueries = 0;
         in.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
-        if (version != 1) {
-            DEBUG_LOG_WARNING("[VisCheck] BVH cache version mismatch (expected 1, got " << version << ")");
-            in.close();
+        in.read(reinterpret_cast<char*>(&numQueries), sizeof(size_t));
+        if (!in || version != QUERY_FILE_VERSION || numQueries > (1u << 28)) {
+            DEBUG_LOG_ERROR("[VisCheck] Invalid query file: " << path);
             return false;
         }
         
-        size_t numMeshes;
-        in.read(reinterpret_cast<char*>(&numMeshes), sizeof(size_t));
-        meshCount = numMeshes;
-        
-        if (numMeshes == 0) {
-            DEBUG_LOG_WARNING("[VisCheck] BVH cache has 0 meshes");
-            in.close();
+        std::vector<QuerySegment> queries(numQueries);
+        in.read(reinterpret_cast<char*>(queries.data()), numQueries * sizeof(QuerySegment));
+        if (!in) {
+            DEBUG_LOG_ERROR("[VisCheck] Truncated query file: " << path);
             return false;
         }
         
-        std::vector<size_t> triangleCounts;
-        triangleCounts.resize(numMeshes);
-        for (size_t i = 0; i < numMeshes; ++i) {
-            in.read(reinterpret_cast<char*>(&triangleCounts[i]), sizeof(size_t));
+        recordedQueries = std::move(queries);
+        return true;
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[VisCheck] Exception loading query file: " << e.what());
+        return false;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[VisCheck] Unknown exception loading query file");
+        return false;
+    }
+}
+
+bool VisCheck::OptimizeForRecordedQueries() {
+    if (!scene) {
+        DEBUG_LOG_ERROR("[VisCheck] No geometry loaded, nothing to optimize");
+        return false;
+    }
+    if (recordedQueries.empty()) {
+        DEBUG_LOG_WARNING("[VisCheck] No recorded queries to optimize for");
+        return false;
+    }
+    
+    auto optimized = scene->OptimizeForQueries(recordedQueries, sceneOptions);
+    if (!optimized) {
+        return false;
+    }
+    scene = std::move(optimized);
+    return true;
+}
+
+bool VisCheck::IsVisibleBatch(const std::vector<QuerySegment>& segments, std::vector<uint8_t>& results) {
+    results.assign(segments.size(), 0);
+    if (!scene && !tiledScene) {
+        DEBUG_LOG_WARNING("[VisCheck] Geometry not loaded, returning false for visibility");
+        return false;
+    }
+    if (segments.size() > std::numeric_limits<uint32_t>::max()) {
+        DEBUG_LOG_ERROR("[VisCheck] Batch of " << segments.size() << " segments is too large");
+        return false;
+    }
+    
+    if (recordingQueries) {
+        for (const QuerySegment& segment : segments) {
+            RecordQuery(segment.from, segment.to);
+        }
+    }
+    
+    if (segments.size() < batchSortThreshold) {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            results[i] = TraceAndLog(segments[i].from, segments[i].to);
+        }
+        return true;
+    }
+    
+    // Key: 15-bit Morton code of the origin cell (32 cells per axis over the
+    // batch), then the direction's cube map face and 7-bit face coordinates
+    Vec3 lo = segments[0].from;
+    Vec3 hi = lo;
+    for (const QuerySegment& segment : segments) {
+        const Vec3& p = segment.from;
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    auto axisScale = [](float extent) {
+        return extent > 0.0f ? 1023.0f / extent : 0.0f;
+    };
+    const Vec3 scale(axisScale(hi.x - lo.x), axisScale(hi.y - lo.y), axisScale(hi.z - lo.z));
+    
+    batchOrder.resize(segments.size());
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const QuerySegment& segment = segments[i];
+        uint32_t cell = MortonCode(segment.from, lo, scale) >> 15;
+        uint32_t direction = DirectionKey(Vec3(segment.to.x - segment.from.x, segment.to.y - segment.from.y, segment.to.z - segment.from.z));
+        uint32_t compact = ((direction >> 16) << 14) | (((direction >> 9) & 0x7F) << 7) | ((direction >> 1) & 0x7F);
+        batchOrder[i] = { (cell << 17) | compact, static_cast<uint32_t>(i) };
+    }
+    RadixSort(batchOrder, batchScratch);
+    
+    for (const auto& entry : batchOrder) {
+        const QuerySegment& segment = segments[entry.second];
+        results[entry.second] = TraceAndLog(segment.from, segment.to);
+    }
+    return true;
+}
+
+bool VisCheck::ComputeVisibilityMatrix(const std::vector<Vec3>& points, VisibilityMatrix& matrix, unsigned threadCount) {
+    const size_t count = points.size();
+    matrix.size = count;
+    matrix.wordsPerRow = (count + 63) / 64;
+    matrix.bits.assign(count * matrix.wordsPerRow, 0);
+    
+    if (!scene && !tiledScene) {
+        DEBUG_LOG_WARNING("[VisCheck] Geometry not loaded, visibility matrix is empty");
+        return false;
+    }
+    
+    // Origins in Morton order, so consecutive rows start close together
+    Vec3 lo = count ? points[0] : Vec3();
+    Vec3 hi = lo;
+    for (const Vec3& p : points) {
+        lo = Vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    auto axisScale = [](float extent) {
+        return extent > 0.0f ? 1023.0f / extent : 0.0f;
+    };
+    const Vec3 scale(axisScale(hi.x - lo.x), axisScale(hi.y - lo.y), axisScale(hi.z - lo.z));
+    
+    std::vector<std::pair<uint32_t, uint32_t>> keyed(count);
+    for (size_t i = 0; i < count; ++i) {
+        keyed[i] = { MortonCode(points[i], lo, scale), static_cast<uint32_t>(i) };
+    }
+    std::sort(keyed.begin(), keyed.end());
+    std::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = keyed[i].second;
+    }
+    
+    // Rank r traces the pairs (order[r], order[s]) for s > r and only writes
+    // row order[r], so rows never share a writer
+    auto traceRow = [&](size_t rank, std::vector<std::pair<uint32_t, uint32_t>>& targets) {
+        const uint32_t origin = order[rank];
+        const Vec3& from = points[origin];
+        targets.clear();
+        for (size_t s = rank + 1; s < count; ++s) {
+            const uint32_t target = order[s];
+            const Vec3& to = points[target];
+            targets.emplace_back(DirectionKey(Vec3(to.x - from.x, to.y - from.y, to.z - from.z)), target);
         }
+        std::sort(targets.begin(), targets.end());
         
-        bvhNodes.clear();
-        for (size_t i = 0; i < numMeshes; ++i) {
-            auto bvhRoot = DeserializeBVHNode(in);
-            if (!bvhRoot) {
-                DEBUG_LOG_ERROR("[VisCheck] Failed to deserialize BVH tree " << i);
-                in.close();
-                return false;
+        uint64_t* row = matrix.bits.data() + origin * matrix.wordsPerRow;
+        row[origin / 64] |= uint64_t(1) << (origin % 64);
+        for (const auto& target : targets) {
+            const Vec3& to = points[target.second];
+            if (TraceSegment(from, to)) {
+                row[target.second / 64] |= uint64_t(1) << (target.second % 64);
             }
-            bvhNodes.push_back(std::move(bvhRoot));
         }
-        
-        meshes.clear();
-        meshes.resize(numMeshes);
-        for (size_t i = 0; i < bvhNodes.size(); ++i) {
-            meshes[i].reserve(triangleCounts[i]);
-            std::function<void(const BVHNode*)> extractTriangles = [&](const BVHNode* node) {
-                if (!node) return;
-                if (node->IsLeaf()) {
-                    meshes[i].insert(meshes[i].end(), node->triangles.begin(), node->triangles.end());
-                } else {
-                    extractTriangles(node->left.get());
-                    extractTriangles(node->right.get());
+    };
+    
+    const size_t pairs = count * (count - (count ? 1 : 0)) / 2;
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadCount = static_cast<unsigned>(std::min<size_t>(threadCount, std::max<size_t>(1, pairs / MIN_PAIRS_PER_THREAD)));
+    
+    if (threadCount <= 1) {
+        std::vector<std::pair<uint32_t, uint32_t>> targets;
+        for (size_t r = 0; r < count; ++r) {
+            traceRow(r, targets);
+        }
+    } else {
+        // Rows shrink with rank; handing them out one at a time balances the load
+        // The calling thread works too, so a failed spawn only costs speed
+        std::atomic<size_t> nextRank(0);
+        auto work = [&]() {
+            std::vector<std::pair<uint32_t, uint32_t>> targets;
+            for (size_t r = nextRank++; r < count; r = nextRank++) {
+                traceRow(r, targets);
+            }
+        };
+        std::vector<std::thread> workers;
+        try {
+            for (unsigned t = 1; t < threadCount; ++t) {
+                workers.emplace_back(work);
+            }
+        } catch (const std::system_error& e) {
+            DEBUG_LOG_WARNING("[VisCheck] Started only " << workers.size() + 1 << " matrix threads: " << e.what());
+        }
+        work();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    // Mirror: each pair was written to exactly one of its two rows
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = i + 1; j < count; ++j) {
+            const bool visible = matrix.Get(i, j) || matrix.Get(j, i);
+            if (visible) {
+                matrix.bits[i * matrix.wordsPerRow + j / 64] |= uint64_t(1) << (j % 64);
+                matrix.bits[j * matrix.wordsPerRow + i / 64] |= uint64_t(1) << (i % 64);
+            }
+        }
+    }
+    
+    return true;
+}
+
+// Packet counterpart of TraceSegment: occluder hits are final, the rest of
+// the packet goes to the scene or, for tiled worlds, one segment at a time
+uint32_t VisCheck::TracePacket(const Vec3& origin, const Vec3* targets, size_t count, size_t maxBlocked) const {
+    uint32_t blocked = occluder ? occluder->TracePacket(origin, targets, count) : 0;
+    size_t blockedCount = CountBits(blocked);
+    if (blockedCount > maxBlocked) {
+        return blocked;
+    }
+    
+    if (tiledScene) {
+        for (size_t k = 0; k < count; ++k) {
+            if (((blocked >> k) & 1u) == 0 && !tiledScene->IsVisible(origin, targets[k])) {
+                blocked |= 1u << k;
+                if (++blockedCount > maxBlocked) {
+                    break;
                 }
-            };
-            extractTriangles(bvhNodes[i].get());
+            }
+        }
+        return blocked;
+    }
+    
+    if (blocked == 0) {
+        return scene->TracePacket(origin, targets, count, maxBlocked);
+    }
+    
+    Vec3 remaining[VisScene::MAX_PACKET_RAYS];
+    uint8_t slots[VisScene::MAX_PACKET_RAYS];
+    size_t remainingCount = 0;
+    for (size_t k = 0; k < count; ++k) {
+        if (((blocked >> k) & 1u) == 0) {
+            slots[remainingCount] = static_cast<uint8_t>(k);
+            remaining[remainingCount++] = targets[k];
+        }
+    }
+    uint32_t sceneBlocked = scene->TracePacket(origin, remaining, remainingCount, maxBlocked - blockedCount);
+    for (size_t k = 0; k < remainingCount; ++k) {
+        if ((sceneBlocked >> k) & 1u) {
+            blocked |= 1u << slots[k];
         }
+    }
+    return blocked;
+}
+
+TargetVisibility VisCheck::GetTargetVisibility(const Vec3& origin, const std::vector<Vec3>& samples, float threshold) {
+    TargetVisibility result;
+    result.total = static_cast<uint32_t>(std::min<size_t>(samples.size(), std::numeric_limits<uint32_t>::max()));
+    if (result.total == 0) {
+        return result;
+    }
+    if (!scene && !tiledScene) {
+        DEBUG_LOG_WARNING("[VisCheck] Geometry not loaded, returning false for visibility");
+        result.blocked = result.total;
+        return result;
+    }
+    
+    // The answer is decided once `needed` samples are visible or more than
+    // total - needed are blocked
+    const bool stopEarly = threshold > 0.0f;
+    uint32_t needed = result.total;
+    if (stopEarly) {
+        float scaled = std::ceil(std::min(threshold, 1.0f) * result.total);
+        needed = std::max<uint32_t>(1, static_cast<uint32_t>(scaled));
+    }
+    
+    size_t offset = 0;
+    size_t round = FIRST_TARGET_ROUND;
+    while (offset < result.total) {
+        const size_t count = std::min(std::min(round, VisScene::MAX_PACKET_RAYS), result.total - offset);
+        const size_t maxBlocked = stopEarly ? (result.total - needed) - result.blocked : VisScene::MAX_PACKET_RAYS;
         
-        in.close();
-        return true;
-    } catch (const std::exception& e) {
-        DEBUG_LOG_ERROR("[VisCheck] Exception loading BVH cache: " << e.what());
+        const uint32_t blockedCount = CountBits(TracePacket(origin, &samples[offset], count, maxBlocked));
+        result.blocked += blockedCount;
+        if (blockedCount > maxBlocked) {
+            break;
+        }
+        result.visible += static_cast<uint32_t>(count) - blockedCount;
+        offset += count;
+        if (stopEarly && result.visible >= needed) {
+            break;
+        }
+        round = VisScene::MAX_PACKET_RAYS;
+    }
+    return result;
+}
+
+TargetVisibility VisCheck::GetTargetVisibility(const Vec3& origin, const AABB& target, int samplesPerAxis, float threshold) {
+    const int n = std::min(std::max(samplesPerAxis, 1), MAX_SAMPLES_PER_AXIS);
+    const uint32_t total = static_cast<uint32_t>(n * n * n);
+    const Vec3 step((target.max.x - target.min.x) / n, (target.max.y - target.min.y) / n, (target.max.z - target.min.z) / n);
+    
+    // Visiting lattice cells in bit-reversed index order spreads every
+    // prefix of the sample list over the box
+    int bits = 0;
+    while ((1u << bits) < total) {
+        ++bits;
+    }
+    
+    targetSamples.clear();
+    for (uint32_t i = 0; i < (1u << bits); ++i) {
+        uint32_t cell = bits > 0 ? ReverseBits(i) >> (32 - bits) : 0;
+        if (cell >= total) {
+            continue;
+        }
+        int x = static_cast<int>(cell % n);
+        int y = static_cast<int>((cell / n) % n);
+        int z = static_cast<int>(cell / (n * n));
+        targetSamples.push_back(Vec3(target.min.x + (x + 0.5f) * step.x,
+            target.min.y + (y + 0.5f) * step.y,
+            target.min.z + (z + 0.5f) * step.z));
+    }
+    
+    return GetTargetVisibility(origin, targetSamples, threshold);
+}
+
+bool VisCheck::LoadOccluderFile(const std::string& filePath) {
+    auto loaded = Occluder::Load(filePath);
+    if (!loaded) {
+        DEBUG_LOG_ERROR("[VisCheck] Failed to load occluder file: " << filePath);
         return false;
-    } catch (...) {
-        DEBUG_LOG_ERROR("[VisCheck] Unknown exception loading BVH cache");
+    }
+    
+    DEBUG_LOG_INFO("[VisCheck] Loaded occluder with " << loaded->GetTriangleCount() << " triangles");
+    occluder = std::move(loaded);
+    return true;
+}
+
+// The occluder lies inside the full geometry, so its hits are final as long
+// as both endpoints are outside it, which Blocks checks
+bool VisCheck::TraceSegment(const Vec3& point1, const Vec3& point2) const {
+    if (occluder && occluder->Blocks(point1, point2)) {
+        return false;
+    }
+    return tiledScene ? tiledScene->IsVisible(point1, point2) : scene->IsVisible(point1, point2);
+}
+
+bool VisCheck::StartTrace(const std::string& path, bool recordLatency) {
+    StopTrace();
+    trace = QueryTrace::Create(path, recordLatency);
+    return trace != nullptr;
+}
+
+bool VisCheck::StopTrace() {
+    if (!trace) {
         return false;
     }
+    bool written = trace->Stop();
+    trace.reset();
+    return written;
 }
 
+bool VisCheck::TraceAndLog(const Vec3& point1, const Vec3& point2) {
+    if (!trace || !trace->IsRecording()) {
+        return TraceSegment(point1, point2);
+    }
+    
+    if (!trace->RecordsLatency()) {
+        bool visible = TraceSegment(point1, point2);
+        trace->Record(point1, point2, visible, 0);
+        return visible;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    bool visible = TraceSegment(point1, point2);
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    trace->Record(point1, point2, visible, static_cast<uint32_t>(std::min<long long>(elapsed, std::numeric_limits<uint32_t>::max())));
+    return visible;
+}
 
 // Check visibility between two points
 bool VisCheck::IsVisible(const Vec3& point1, const Vec3& point2) {
-    if (!geometryLoaded || bvhNodes.empty()) {
+    if (tiledScene) {
+        if (recordingQueries) {
+            RecordQuery(point1, point2);
+        }
+        return TraceAndLog(point1, point2);
+    }
+    
+    if (!scene) {
         static bool logged = false;
         if (!logged) {
             DEBUG_LOG_WARNING("[VisCheck] Geometry not loaded or BVH empty, returning false for visibility");
@@ -472,28 +705,47 @@ bool VisCheck::IsVisible(const Vec3& point1, const Vec3& point2) {
         return false;
     }
     
-    Vec3 rayDir = Vec3Helpers::Subtract(point2, point1);
-    float distance = std::sqrt(Vec3Helpers::LengthSquared(rayDir));
-    
-    if (distance < 0.001f) {
-        return true;
+    if (recordingQueries) {
+        RecordQuery(point1, point2);
     }
     
-    rayDir.x /= distance;
-    rayDir.y /= distance;
-    rayDir.z /= distance;
-    
-    float hitDistance = std::numeric_limits<float>::max();
-    
-    for (const auto& bvhRoot : bvhNodes) {
-        if (bvhRoot && IntersectBVH(bvhRoot.get(), point1, rayDir, distance, hitDistance)) {
-            if (hitDistance < distance) {
-                return false;
-            }
-        }
+    return TraceAndLog(point1, point2);
+}
+
+bool VisCheck::SetMeshFlags(const std::vector<uint32_t>& flags) {
+    if (!scene) {
+        DEBUG_LOG_ERROR("[VisCheck] No geometry loaded, cannot set mesh flags");
+        return false;
     }
-    
+    auto flagged = scene->WithMeshFlags(flags, sceneOptions);
+    if (!flagged) {
+        return false;
+    }
+    scene = std::move(flagged);
     return true;
 }
 
+bool VisCheck::IsVisible(const Vec3& point1, const Vec3& point2, uint32_t ignoreFlags) {
+    if (ignoreFlags == 0) {
+        return IsVisible(point1, point2);
+    }
+    
+    if (tiledScene) {
+        return tiledScene->IsVisible(point1, point2, ignoreFlags);
+    }
+    
+    if (!scene) {
+        return false;
+    }
+    return scene->IsVisible(point1, point2, ignoreFlags);
+}
 
+bool VisCheck::Raycast(const Vec3& from, const Vec3& to, RayHit& hit, uint32_t ignoreFlags) const {
+    if (!scene) {
+        if (tiledScene) {
+            DEBUG_LOG_WARNING("[VisCheck] Raycast is not supported on tiled scenes");
+        }
+        return false;
+    }
+    return scene->Raycast(from, to, hit, ignoreFlags);
+}
@@ -0,0 +1,1757 @@
+#include "VisScene.h"
+#include "Debug.h"
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <atomic>
+#include <limits>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Vec3Helpers {
+    inline Vec3 Subtract(const Vec3& a, const Vec3& b) {
+        return Vec3(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+
+    inline float Dot(const Vec3& a, const Vec3& b) {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    inline Vec3 Cross(const Vec3& a, const Vec3& b) {
+        return Vec3(
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x
+        );
+    }
+
+    inline float LengthSquared(const Vec3& v) {
+        return v.x * v.x + v.y * v.y + v.z * v.z;
+    }
+}
+
+namespace {
+    const uint32_t SCENE_MAGIC = 0x4E435356; // "VSCN"
+    const uint32_t SCENE_VERSION = 3;
+    // Version 2 blobs have no source indices; tiled files still hold them
+    const uint32_t SCENE_VERSION_NO_SOURCES = 2;
+    const size_t SCENE_ALIGNMENT = 64;
+
+    // BVH cache versions: 1 holds triangle meshes only, 2 adds primitive
+    // types, 3 adds mesh flags and 4 the input index of every primitive
+    const uint32_t CACHE_VERSION_TRIANGLES = 1;
+    const uint32_t CACHE_VERSION_HULLS = 2;
+    const uint32_t CACHE_VERSION_FLAGS = 3;
+    const uint32_t CACHE_VERSION = 4;
+
+    // Layout of the scene blob. Offsets are relative to the start of the blob
+    // so it can be mapped at any address.
+    struct SceneHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t totalSize;
+        uint64_t meshCount;
+        uint64_t nodeCount;
+        uint64_t triangleCount;
+        uint64_t hullCount;
+        uint64_t planeCount;
+        uint64_t meshOffset;
+        uint64_t nodeOffset;
+        uint64_t triangleOffset;
+        uint64_t hullOffset;
+        uint64_t planeOffset;
+        uint64_t gridOffset;
+        uint64_t gridSize;
+        // Added in version 3: triangleCount + hullCount source indices
+        uint64_t sourceOffset;
+    };
+
+    inline size_t AlignUp(size_t value) {
+        return (value + SCENE_ALIGNMENT - 1) & ~(SCENE_ALIGNMENT - 1);
+    }
+
+    inline AABB PrimitiveBounds(const TriangleCombined& tri) {
+        return tri.ComputeAABB();
+    }
+
+    inline AABB PrimitiveBounds(const SceneHull& hull) {
+        return hull.bounds;
+    }
+
+    // Primitive tagged with its index in the mesh or hull set it came from,
+    // so the index survives the BVH build sorting primitives
+    template<typename T>
+    struct Sourced {
+        T primitive;
+        uint32_t source;
+    };
+
+    template<typename T>
+    inline AABB PrimitiveBounds(const Sourced<T>& item) {
+        return PrimitiveBounds(item.primitive);
+    }
+
+    template<typename T>
+    inline float Centroid(const T& primitive, int axis) {
+        AABB b = PrimitiveBounds(primitive);
+        return ((&b.min.x)[axis] + (&b.max.x)[axis]) / 2.0f;
+    }
+
+    void Extend(AABB& bounds, const AABB& other) {
+        bounds.min.x = std::min(bounds.min.x, other.min.x);
+        bounds.min.y = std::min(bounds.min.y, other.min.y);
+        bounds.min.z = std::min(bounds.min.z, other.min.z);
+        bounds.max.x = std::max(bounds.max.x, other.max.x);
+        bounds.max.y = std::max(bounds.max.y, other.max.y);
+        bounds.max.z = std::max(bounds.max.z, other.max.z);
+    }
+
+    // Median split on the longest axis. Sorts prims[first, first + count) in
+    // place so every leaf ends up referencing a contiguous range.
+    template<typename T>
+    uint32_t BuildNode(std::vector<BVHNode>& nodes, std::vector<T>& prims, uint32_t first, uint32_t count) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        AABB bounds = PrimitiveBounds(prims[first]);
+        for (uint32_t i = first + 1; i < first + count; ++i) {
+            Extend(bounds, PrimitiveBounds(prims[i]));
+        }
+
+        BVHNode node;
+        node.bounds = bounds;
+        node.left = 0;
+        node.right = 0;
+        node.firstPrimitive = 0;
+        node.primitiveCount = 0;
+
+        if (count <= VisScene::LEAF_THRESHOLD) {
+            node.firstPrimitive = first;
+            node.primitiveCount = count;
+            nodes[index] = node;
+            return index;
+        }
+
+        Vec3 diff = Vec3Helpers::Subtract(bounds.max, bounds.min);
+        int axis = (diff.x > diff.y && diff.x > diff.z) ? 0 : ((diff.y > diff.z) ? 1 : 2);
+
+        std::sort(prims.begin() + first, prims.begin() + first + count, [axis](const T& a, const T& b) {
+            return Centroid(a, axis) < Centroid(b, axis);
+        });
+
+        uint32_t mid = count / 2;
+        node.left = BuildNode(nodes, prims, first, mid);
+        node.right = BuildNode(nodes, prims, first + mid, count - mid);
+        nodes[index] = node;
+        return index;
+    }
+
+    bool RayIntersectsTriangle(const Vec3& rayOrigin, const Vec3& rayDir,
+        const TriangleCombined& triangle, float& t) {
+        const float EPSILON = 1e-7f;
+
+        Vec3 edge1 = Vec3Helpers::Subtract(triangle.v1, triangle.v0);
+        Vec3 edge2 = Vec3Helpers::Subtract(triangle.v2, triangle.v0);
+        Vec3 h = Vec3Helpers::Cross(rayDir, edge2);
+        float a = Vec3Helpers::Dot(edge1, h);
+
+        if (a > -EPSILON && a < EPSILON)
+            return false;
+
+        float f = 1.0f / a;
+        Vec3 s = Vec3Helpers::Subtract(rayOrigin, triangle.v0);
+        float u = f * Vec3Helpers::Dot(s, h);
+
+        if (u < 0.0f || u > 1.0f)
+            return false;
+
+        Vec3 q = Vec3Helpers::Cross(s, edge1);
+        float v = f * Vec3Helpers::Dot(rayDir, q);
+
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+
+        t = f * Vec3Helpers::Dot(edge2, q);
+
+        return (t > EPSILON);
+    }
+
+    // Read-only view of the arrays a BVH cache is written from
+    struct CacheSource {
+        const BVHNode* nodes;
+        const TriangleCombined* triangles;
+        const SceneHull* hulls;
+        const HullPlane* planes;
+        const uint32_t* triangleSources;
+        const uint32_t* hullSources;
+    };
+
+    void WritePrimitive(std::ofstream& out, const CacheSource& source, uint32_t primitiveType, uint32_t index) {
+        if (primitiveType == SceneMesh::Hulls) {
+            const SceneHull& hull = source.hulls[index];
+            out.write(reinterpret_cast<const char*>(&hull.bounds.min), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&hull.bounds.max), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&hull.planeCount), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&source.planes[hull.firstPlane]), hull.planeCount * sizeof(HullPlane));
+            out.write(reinterpret_cast<const char*>(&source.hullSources[index]), sizeof(uint32_t));
+        } else {
+            const TriangleCombined& tri = source.triangles[index];
+            out.write(reinterpret_cast<const char*>(&tri.v0), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&tri.v1), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&tri.v2), sizeof(Vec3));
+            out.write(reinterpret_cast<const char*>(&source.triangleSources[index]), sizeof(uint32_t));
+        }
+    }
+
+    void SerializeBVHNode(std::ofstream& out, const CacheSource& source, uint32_t primitiveType, uint32_t index) {
+        if (index == SceneMesh::INVALID_NODE) {
+            bool isNull = true;
+            out.write(reinterpret_cast<const char*>(&isNull), sizeof(bool));
+            return;
+        }
+
+        const BVHNode& node = source.nodes[index];
+        bool isNull = false;
+        out.write(reinterpret_cast<const char*>(&isNull), sizeof(bool));
+
+        out.write(reinterpret_cast<const char*>(&node.bounds.min), sizeof(Vec3));
+        out.write(reinterpret_cast<const char*>(&node.bounds.max), sizeof(Vec3));
+
+        bool isLeaf = node.IsLeaf();
+        out.write(reinterpret_cast<const char*>(&isLeaf), sizeof(bool));
+
+        if (isLeaf) {
+            size_t numPrims = node.primitiveCount;
+            out.write(reinterpret_cast<const char*>(&numPrims), sizeof(size_t));
+            for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.primitiveCount; ++i) {
+                WritePrimitive(out, source, primitiveType, i);
+            }
+        } else {
+            SerializeBVHNode(out, source, primitiveType, node.left);
+            SerializeBVHNode(out, source, primitiveType, node.right);
+        }
+    }
+
+    // sources receives the primitive's input index; null for caches that
+    // predate them
+    bool ReadPrimitive(std::ifstream& in, uint32_t primitiveType, std::vector<TriangleCombined>& tris,
+        std::vector<SceneHull>& hulls, std::vector<HullPlane>& planes, std::vector<uint32_t>* sources) {
+        if (primitiveType == SceneMesh::Hulls) {
+            SceneHull hull;
+            in.read(reinterpret_cast<char*>(&hull.bounds.min), sizeof(Vec3));
+            in.read(reinterpret_cast<char*>(&hull.bounds.max), sizeof(Vec3));
+            in.read(reinterpret_cast<char*>(&hull.planeCount), sizeof(uint32_t));
+            if (!in || hull.planeCount == 0 || hull.planeCount > 0xFFFFu) {
+                return false;
+            }
+            hull.firstPlane = static_cast<uint32_t>(planes.size());
+            planes.resize(planes.size() + hull.planeCount);
+            in.read(reinterpret_cast<char*>(&planes[hull.firstPlane]), hull.planeCount * sizeof(HullPlane));
+            hulls.push_back(hull);
+        } else {
+            TriangleCombined tri;
+            in.read(reinterpret_cast<char*>(&tri.v0), sizeof(Vec3));
+            in.read(reinterpret_cast<char*>(&tri.v1), sizeof(Vec3));
+            in.read(reinterpret_cast<char*>(&tri.v2), sizeof(Vec3));
+            tris.push_back(tri);
+        }
+        if (sources) {
+            uint32_t source = 0;
+            in.read(reinterpret_cast<char*>(&source), sizeof(uint32_t));
+            sources->push_back(source);
+        }
+        return static_cast<bool>(in);
+    }
+
+    // Returns INVALID_NODE for a null node and sets ok to false on corrupt input
+    uint32_t DeserializeBVHNode(std::ifstream& in, uint32_t primitiveType, std::vector<BVHNode>& nodes,
+        std::vector<TriangleCombined>& tris, std::vector<SceneHull>& hulls, std::vector<HullPlane>& planes,
+        std::vector<uint32_t>* sources, int depth, bool& ok) {
+        bool isNull;
+        in.read(reinterpret_cast<char*>(&isNull), sizeof(bool));
+
+        if (!in || isNull) {
+            ok = ok && static_cast<bool>(in);
+            return SceneMesh::INVALID_NODE;
+        }
+        if (depth > VisScene::MAX_BVH_DEPTH) {
+            ok = false;
+            return SceneMesh::INVALID_NODE;
+        }
+
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        BVHNode node;
+        node.left = 0;
+        node.right = 0;
+        node.firstPrimitive = 0;
+        node.primitiveCount = 0;
+        in.read(reinterpret_cast<char*>(&node.bounds.min), sizeof(Vec3));
+        in.read(reinterpret_cast<char*>(&node.bounds.max), sizeof(Vec3));
+
+        bool isLeaf;
+        in.read(reinterpret_cast<char*>(&isLeaf), sizeof(bool));
+
+        if (isLeaf) {
+            size_t numPrims = 0;
+            in.read(reinterpret_cast<char*>(&numPrims), sizeof(size_t));
+            if (!in || numPrims == 0 || numPrims > 0xFFFFu) {
+                ok = false;
+                return SceneMesh::INVALID_NODE;
+            }
+            node.firstPrimitive = static_cast<uint32_t>(primitiveType == SceneMesh::Hulls ? hulls.size() : tris.size());
+            node.primitiveCount = static_cast<uint32_t>(numPrims);
+            for (size_t i = 0; i < numPrims; ++i) {
+                if (!ReadPrimitive(in, primitiveType, tris, hulls, planes, sources)) {
+                    ok = false;
+                    return SceneMesh::INVALID_NODE;
+                }
+            }
+        } else {
+            node.left = DeserializeBVHNode(in, primitiveType, nodes, tris, hulls, planes, sources, depth + 1, ok);
+            node.right = DeserializeBVHNode(in, primitiveType, nodes, tris, hulls, planes, sources, depth + 1, ok);
+            if (node.left == SceneMesh::INVALID_NODE || node.right == SceneMesh::INVALID_NODE) {
+                ok = false;
+            }
+        }
+
+        nodes[index] = node;
+        return index;
+    }
+
+    // Query sample prepared the way IsVisible traverses it
+    struct SampleRay {
+        Vec3 origin;
+        Vec3 dir;
+        Vec3 invDir;
+    };
+
+    // Same slab test as AABB::RayIntersects with the reciprocal precomputed
+    inline bool SampleEnters(const AABB& bounds, const SampleRay& ray) {
+        float tmin = std::numeric_limits<float>::lowest();
+        float tmax = std::numeric_limits<float>::max();
+        for (int i = 0; i < 3; ++i) {
+            float invDir = (&ray.invDir.x)[i];
+            float t0 = ((&bounds.min.x)[i] - (&ray.origin.x)[i]) * invDir;
+            float t1 = ((&bounds.max.x)[i] - (&ray.origin.x)[i]) * invDir;
+            if (invDir < 0.0f) std::swap(t0, t1);
+            tmin = std::max(tmin, t0);
+            tmax = std::min(tmax, t1);
+        }
+        return tmax >= tmin && tmax >= 0;
+    }
+
+    // Relative slack on packet bounds so rounding in the hit distance cannot
+    // cull a node holding a hit right at a target point
+    const float PACKET_BOUNDS_PADDING = 1e-5f;
+
+    inline bool Overlaps(const AABB& a, const AABB& b) {
+        return a.min.x <= b.max.x && a.max.x >= b.min.x &&
+            a.min.y <= b.max.y && a.max.y >= b.min.y &&
+            a.min.z <= b.max.z && a.max.z >= b.min.z;
+    }
+
+    // Slab test limited to the part of the ray between 0 and maxDistance;
+    // distance is where the ray enters the box
+    inline bool ClipToBounds(const AABB& bounds, const SampleRay& ray, float maxDistance, float& distance) {
+        float tmin = 0.0f;
+        float tmax = maxDistance;
+        for (int i = 0; i < 3; ++i) {
+            float invDir = (&ray.invDir.x)[i];
+            float t0 = ((&bounds.min.x)[i] - (&ray.origin.x)[i]) * invDir;
+            float t1 = ((&bounds.max.x)[i] - (&ray.origin.x)[i]) * invDir;
+            if (invDir < 0.0f) std::swap(t0, t1);
+            tmin = std::max(tmin, t0);
+            tmax = std::min(tmax, t1);
+        }
+        distance = tmin;
+        return tmin <= tmax;
+    }
+
+    // Share of the node cost taken from surface area rather than recorded
+    // rays, so regions the samples missed do not degrade arbitrarily
+    const float SURFACE_COST_WEIGHT = 0.1f;
+    const int MAX_ROTATIONS_PER_NODE = 4;
+    const int MAX_OPTIMIZE_PASSES = 3;
+
+    float SurfaceArea(const AABB& bounds) {
+        Vec3 d = Vec3Helpers::Subtract(bounds.max, bounds.min);
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    AABB Union(const AABB& a, const AABB& b) {
+        AABB bounds = a;
+        Extend(bounds, b);
+        return bounds;
+    }
+
+    // Tree rotations weighted by recorded rays. Each rotation swaps a child
+    // with a grandchild, which only changes the bounds of the node in
+    // between, so its gain is the change in how many sample rays enter that
+    // node. Leaves and their primitive ranges are never touched.
+    class RotationOptimizer {
+    public:
+        RotationOptimizer(std::vector<BVHNode>& nodes, const std::vector<SampleRay>& rays)
+            : nodes(nodes), rays(rays), rotations(0) {}
+
+        size_t Optimize(uint32_t root) {
+            std::vector<uint32_t> subset;
+            subset.reserve(rays.size());
+            for (uint32_t i = 0; i < rays.size(); ++i) {
+                if (SampleEnters(nodes[root].bounds, rays[i])) {
+                    subset.push_back(i);
+                }
+            }
+
+            size_t total = 0;
+            for (int pass = 0; pass < MAX_OPTIMIZE_PASSES; ++pass) {
+                rotations = 0;
+                OptimizeNode(root, subset);
+                total += rotations;
+                if (rotations == 0) {
+                    break;
+                }
+            }
+            return total;
+        }
+
+    private:
+        std::vector<BVHNode>& nodes;
+        const std::vector<SampleRay>& rays;
+        size_t rotations;
+
+        // Candidate i swaps the sibling of pivot i / 2 with the pivot's left
+        // (even) or right (odd) child
+        bool TryRotate(uint32_t index, const std::vector<uint32_t>& subset) {
+            const BVHNode& node = nodes[index];
+            const uint32_t pivots[2] = { node.right, node.left };
+            const uint32_t siblings[2] = { node.left, node.right };
+
+            AABB boxes[6];
+            bool valid[2];
+            for (int p = 0; p < 2; ++p) {
+                const BVHNode& pivot = nodes[pivots[p]];
+                const AABB& sibling = nodes[siblings[p]].bounds;
+                valid[p] = !pivot.IsLeaf();
+                if (valid[p]) {
+                    boxes[p * 3] = pivot.bounds;
+                    boxes[p * 3 + 1] = Union(sibling, nodes[pivot.right].bounds);
+                    boxes[p * 3 + 2] = Union(nodes[pivot.left].bounds, sibling);
+                }
+            }
+            if (!valid[0] && !valid[1]) {
+                return false;
+            }
+
+            size_t hits[6] = {};
+            for (uint32_t i : subset) {
+                for (int b = 0; b < 6; ++b) {
+                    if (valid[b / 3] && SampleEnters(boxes[b], rays[i])) {
+                        ++hits[b];
+                    }
+                }
+            }
+
+            const float parentArea = SurfaceArea(node.bounds);
+            auto cost = [&](int b) {
+                float areaRatio = parentArea > 0.0f ? SurfaceArea(boxes[b]) / parentArea : 1.0f;
+                return (1.0f - SURFACE_COST_WEIGHT) * hits[b] + SURFACE_COST_WEIGHT * subset.size() * areaRatio;
+            };
+
+            // Ignore gains too small to matter so passes settle quickly
+            float bestGain = 0.001f * subset.size();
+            int best = -1;
+            for (int p = 0; p < 2; ++p) {
+                if (!valid[p]) {
+                    continue;
+                }
+                const float current = cost(p * 3);
+                for (int c = 1; c <= 2; ++c) {
+                    float gain = current - cost(p * 3 + c);
+                    if (gain > bestGain) {
+                        bestGain = gain;
+                        best = p * 3 + c;
+                    }
+                }
+            }
+            if (best < 0) {
+                return false;
+            }
+
+            const int p = best / 3;
+            BVHNode& parent = nodes[index];
+            BVHNode& pivot = nodes[pivots[p]];
+            uint32_t& sibling = p == 0 ? parent.left : parent.right;
+            uint32_t& grandchild = best % 3 == 1 ? pivot.left : pivot.right;
+            std::swap(sibling, grandchild);
+            pivot.bounds = boxes[best];
+            ++rotations;
+            return true;
+        }
+
+        void OptimizeNode(uint32_t index, const std::vector<uint32_t>& subset) {
+            if (nodes[index].IsLeaf() || subset.empty()) {
+                return;
+            }
+
+            for (int i = 0; i < MAX_ROTATIONS_PER_NODE && TryRotate(index, subset); ++i) {
+            }
+
+            const uint32_t children[2] = { nodes[index].left, nodes[index].right };
+            for (uint32_t child : children) {
+                std::vector<uint32_t> childSubset;
+                for (uint32_t i : subset) {
+                    if (SampleEnters(nodes[child].bounds, rays[i])) {
+                        childSubset.push_back(i);
+                    }
+                }
+                OptimizeNode(child, childSubset);
+            }
+        }
+    };
+
+    // Copy a tree into dst in depth-first order so traversal walks memory
+    // forward. Returns INVALID_NODE if the tree is deeper than traversal allows.
+    uint32_t RelayoutNode(const std::vector<BVHNode>& src, uint32_t index, std::vector<BVHNode>& dst, int depth) {
+        if (depth > VisScene::MAX_BVH_DEPTH) {
+            return SceneMesh::INVALID_NODE;
+        }
+
+        uint32_t newIndex = static_cast<uint32_t>(dst.size());
+        dst.push_back(src[index]);
+        if (!src[index].IsLeaf()) {
+            uint32_t left = RelayoutNode(src, src[index].left, dst, depth + 1);
+            uint32_t right = left == SceneMesh::INVALID_NODE ? left : RelayoutNode(src, src[index].right, dst, depth + 1);
+            if (right == SceneMesh::INVALID_NODE) {
+                return SceneMesh::INVALID_NODE;
+            }
+            dst[newIndex].left = left;
+            dst[newIndex].right = right;
+        }
+        return newIndex;
+    }
+
+    // Nodes a full traversal of every sample enters, the quantity the
+    // optimizer minimizes
+    size_t CountNodeVisits(const std::vector<BVHNode>& nodes, uint32_t root, const std::vector<SampleRay>& rays) {
+        size_t visits = 0;
+        std::vector<uint32_t> stack;
+        for (const SampleRay& ray : rays) {
+            stack.push_back(root);
+            while (!stack.empty()) {
+                const BVHNode& node = nodes[stack.back()];
+                stack.pop_back();
+                if (!SampleEnters(node.bounds, ray)) {
+                    continue;
+                }
+                ++visits;
+                if (!node.IsLeaf()) {
+                    stack.push_back(node.right);
+                    stack.push_back(node.left);
+                }
+            }
+        }
+        return visits;
+    }
+
+#ifdef _WIN32
+    std::string SharedObjectName(const std::string& name) {
+        return "Local\\" + name;
+    }
+#else
+    std::string SharedObjectName(const std::string& name) {
+        return (!name.empty() && name[0] == '/') ? name : "/" + name;
+    }
+#endif
+
+    // Copy a scene blob into a segment other processes may already have open.
+    // The magic is written last so readers never accept a partial scene.
+    void CopyToSegment(void* segment, const unsigned char* data, size_t size) {
+        unsigned char* dest = static_cast<unsigned char*>(segment);
+        std::memset(dest, 0, sizeof(uint32_t));
+        std::memcpy(dest + sizeof(uint32_t), data + sizeof(uint32_t), size - sizeof(uint32_t));
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(dest, data, sizeof(uint32_t));
+    }
+}
+
+// Geometry of a scene before it is packed into a blob
+struct VisScene::Parts {
+    std::vector<SceneMesh> meshes;
+    std::vector<BVHNode> nodes;
+    std::vector<TriangleCombined> triangles;
+    std::vector<SceneHull> hulls;
+    std::vector<HullPlane> planes;
+    // Input index of each triangle and hull, parallel to triangles and hulls
+    std::vector<uint32_t> triangleSources;
+    std::vector<uint32_t> hullSources;
+};
+
+bool AABB::RayIntersects(const Vec3& rayOrigin, const Vec3& rayDir) const {
+    float tmin = std::numeric_limits<float>::lowest();
+    float tmax = std::numeric_limits<float>::max();
+
+    const float* rayOriginArr = &rayOrigin.x;
+    const float* rayDirArr = &rayDir.x;
+    const float* minArr = &min.x;
+    const float* maxArr = &max.x;
+
+    for (int i = 0; i < 3; ++i) {
+        float invDir = 1.0f / rayDirArr[i];
+        float t0 = (minArr[i] - rayOriginArr[i]) * invDir;
+        float t1 = (maxArr[i] - rayOriginArr[i]) * invDir;
+
+        if (invDir < 0.0f) std::swap(t0, t1);
+        tmin = std::max(tmin, t0);
+        tmax = std::min(tmax, t1);
+    }
+
+    return tmax >= tmin && tmax >= 0;
+}
+
+AABB TriangleCombined::ComputeAABB() const {
+    Vec3 min_point, max_point;
+
+    min_point.x = std::min({ v0.x, v1.x, v2.x });
+    min_point.y = std::min({ v0.y, v1.y, v2.y });
+    min_point.z = std::min({ v0.z, v1.z, v2.z });
+
+    max_point.x = std::max({ v0.x, v1.x, v2.x });
+    max_point.y = std::max({ v0.y, v1.y, v2.y });
+    max_point.z = std::max({ v0.z, v1.z, v2.z });
+
+    return { min_point, max_point };
+}
+
+bool HullCombined::ContainsPoint(const Vec3& p, float tolerance) const {
+    for (const auto& plane : planes) {
+        if (Vec3Helpers::Dot(plane.normal, p) - plane.offset > tolerance) {
+            return false;
+        }
+    }
+    return true;
+}
+
+VisScene::VisScene()
+    : mappedData(nullptr), mappedSize(0), mappingHandle(nullptr), blob(nullptr), dataSize(0),
+    meshCount(0), nodeCount(0), triangleCount(0), hullCount(0), planeCount(0),
+    meshes(nullptr), nodes(nullptr), triangles(nullptr), hulls(nullptr), planes(nullptr), sources(nullptr) {
+}
+
+VisScene::~VisScene() {
+    if (mappedData) {
+#ifdef _WIN32
+        UnmapViewOfFile(mappedData);
+#else
+        munmap(mappedData, mappedSize);
+#endif
+    }
+#ifdef _WIN32
+    if (mappingHandle) {
+        CloseHandle(static_cast<HANDLE>(mappingHandle));
+    }
+#endif
+}
+
+std::shared_ptr<const VisScene> VisScene::Build(const std::vector<std::vector<TriangleCombined>>& geometryMeshes, const VisSceneOptions& options) {
+    return Build(geometryMeshes, std::vector<std::vector<HullCombined>>(), options);
+}
+
+std::shared_ptr<const VisScene> VisScene::Build(const std::vector<std::vector<TriangleCombined>>& geometryMeshes,
+    const std::vector<std::vector<HullCombined>>& hullSets, const VisSceneOptions& options) {
+    Parts parts;
+
+    size_t totalTriangles = 0;
+    for (const auto& mesh : geometryMeshes) {
+        totalTriangles += mesh.size();
+    }
+    if (totalTriangles >= SceneMesh::INVALID_NODE) {
+        DEBUG_LOG_ERROR("[VisScene] Too many triangles for one scene: " << totalTriangles);
+        return nullptr;
+    }
+    std::vector<Sourced<TriangleCombined>> sortedTriangles;
+    sortedTriangles.reserve(totalTriangles);
+
+    for (size_t i = 0; i < geometryMeshes.size(); ++i) {
+        const auto& mesh = geometryMeshes[i];
+
+        SceneMesh record;
+        record.rootNode = SceneMesh::INVALID_NODE;
+        record.nodeCount = 0;
+        record.firstPrimitive = static_cast<uint32_t>(sortedTriangles.size());
+        record.primitiveCount = static_cast<uint32_t>(mesh.size());
+        record.primitiveType = SceneMesh::Triangles;
+        record.flags = 0;
+
+        if (mesh.empty()) {
+            DEBUG_LOG_WARNING("[VisScene] Mesh " << i << " is empty, skipping");
+        } else {
+            DEBUG_LOG_INFO("[VisScene] Building BVH for mesh " << i << " with " << mesh.size() << " triangles...");
+            for (size_t j = 0; j < mesh.size(); ++j) {
+                sortedTriangles.push_back({ mesh[j], static_cast<uint32_t>(j) });
+            }
+            size_t firstNode = parts.nodes.size();
+            record.rootNode = BuildNode(parts.nodes, sortedTriangles, record.firstPrimitive, record.primitiveCount);
+            record.nodeCount = static_cast<uint32_t>(parts.nodes.size() - firstNode);
+        }
+        parts.meshes.push_back(record);
+    }
+
+    parts.triangles.reserve(totalTriangles);
+    parts.triangleSources.reserve(totalTriangles);
+    for (const auto& item : sortedTriangles) {
+        parts.triangles.push_back(item.primitive);
+        parts.triangleSources.push_back(item.source);
+    }
+    std::vector<Sourced<TriangleCombined>>().swap(sortedTriangles);
+
+    std::vector<Sourced<SceneHull>> sortedHulls;
+    for (size_t i = 0; i < hullSets.size(); ++i) {
+        SceneMesh record;
+        record.rootNode = SceneMesh::INVALID_NODE;
+        record.nodeCount = 0;
+        record.firstPrimitive = static_cast<uint32_t>(sortedHulls.size());
+        record.primitiveType = SceneMesh::Hulls;
+        record.flags = 0;
+
+        for (size_t j = 0; j < hullSets[i].size(); ++j) {
+            const HullCombined& hull = hullSets[i][j];
+            if (hull.planes.empty()) {
+                continue;
+            }
+            SceneHull stored;
+            stored.bounds = hull.bounds;
+            stored.firstPlane = static_cast<uint32_t>(parts.planes.size());
+            stored.planeCount = static_cast<uint32_t>(hull.planes.size());
+            parts.planes.insert(parts.planes.end(), hull.planes.begin(), hull.planes.end());
+            sortedHulls.push_back({ stored, static_cast<uint32_t>(j) });
+        }
+        record.primitiveCount = static_cast<uint32_t>(sortedHulls.size() - record.firstPrimitive);
+
+        if (record.primitiveCount == 0) {
+            DEBUG_LOG_WARNING("[VisScene] Hull set " << i << " is empty, skipping");
+        } else {
+            DEBUG_LOG_INFO("[VisScene] Building BVH for hull set " << i << " with " << record.primitiveCount << " hulls...");
+            size_t firstNode = parts.nodes.size();
+            record.rootNode = BuildNode(parts.nodes, sortedHulls, record.firstPrimitive, record.primitiveCount);
+            record.nodeCount = static_cast<uint32_t>(parts.nodes.size() - firstNode);
+        }
+        parts.meshes.push_back(record);
+    }
+
+    for (const auto& item : sortedHulls) {
+        parts.hulls.push_back(item.primitive);
+        parts.hullSources.push_back(item.source);
+    }
+
+    if (parts.triangles.empty() && parts.hulls.empty()) {
+        DEBUG_LOG_ERROR("[VisScene] No triangles or hulls in geometry");
+        return nullptr;
+    }
+
+    return FromParts(parts, options);
+}
+
+std::shared_ptr<const VisScene> VisScene::FromParts(const Parts& parts, const VisSceneOptions& options) {
+    if (parts.triangleSources.size() != parts.triangles.size() || parts.hullSources.size() != parts.hulls.size()) {
+        DEBUG_LOG_ERROR("[VisScene] Source indices do not match the primitives");
+        return nullptr;
+    }
+
+    OccupancyGrid occupancy;
+    if (options.occupancyCellSize > 0.0f) {
+        std::vector<std::vector<TriangleCombined>> meshLists;
+        std::vector<HullCombined> hullList;
+        for (const auto& mesh : parts.meshes) {
+            if (mesh.primitiveType == SceneMesh::Hulls) {
+                for (uint32_t i = mesh.firstPrimitive; i < mesh.firstPrimitive + mesh.primitiveCount; ++i) {
+                    const SceneHull& hull = parts.hulls[i];
+                    HullCombined combined;
+                    combined.bounds = hull.bounds;
+                    combined.planes.assign(parts.planes.begin() + hull.firstPlane, parts.planes.begin() + hull.firstPlane + hull.planeCount);
+                    hullList.push_back(std::move(combined));
+                }
+            } else {
+                auto begin = parts.triangles.begin() + mesh.firstPrimitive;
+                meshLists.emplace_back(begin, begin + mesh.primitiveCount);
+            }
+        }
+        if (!occupancy.Build(meshLists, hullList, options.occupancyCellSize)) {
+            DEBUG_LOG_WARNING("[VisScene] Failed to build occupancy grid, using BVH only");
+        }
+    }
+
+    SceneHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = SCENE_MAGIC;
+    header.version = SCENE_VERSION;
+    header.meshCount = parts.meshes.size();
+    header.nodeCount = parts.nodes.size();
+    header.triangleCount = parts.triangles.size();
+    header.hullCount = parts.hulls.size();
+    header.planeCount = parts.planes.size();
+
+    size_t offset = AlignUp(sizeof(SceneHeader));
+    header.meshOffset = offset;
+    offset = AlignUp(offset + parts.meshes.size() * sizeof(SceneMesh));
+    header.nodeOffset = offset;
+    offset = AlignUp(offset + parts.nodes.size() * sizeof(BVHNode));
+    header.triangleOffset = offset;
+    offset = AlignUp(offset + parts.triangles.size() * sizeof(TriangleCombined));
+    header.hullOffset = offset;
+    offset = AlignUp(offset + parts.hulls.size() * sizeof(SceneHull));
+    header.planeOffset = offset;
+    offset = AlignUp(offset + parts.planes.size() * sizeof(HullPlane));
+    header.sourceOffset = offset;
+    offset = AlignUp(offset + (parts.triangles.size() + parts.hulls.size()) * sizeof(uint32_t));
+    header.gridOffset = offset;
+    header.gridSize = occupancy.IsBuilt() ? occupancy.SerializedSize() : 0;
+    offset += header.gridSize;
+    header.totalSize = offset;
+
+    std::shared_ptr<VisScene> scene(new VisScene());
+    scene->storage.resize(offset);
+    unsigned char* data = scene->storage.data();
+
+    auto copyArray = [data](uint64_t at, const auto& items) {
+        if (!items.empty()) {
+            std::memcpy(data + at, items.data(), items.size() * sizeof(items[0]));
+        }
+    };
+    std::memcpy(data, &header, sizeof(header));
+    copyArray(header.meshOffset, parts.meshes);
+    copyArray(header.nodeOffset, parts.nodes);
+    copyArray(header.triangleOffset, parts.triangles);
+    copyArray(header.hullOffset, parts.hulls);
+    copyArray(header.planeOffset, parts.planes);
+    copyArray(header.sourceOffset, parts.triangleSources);
+    copyArray(header.sourceOffset + parts.triangleSources.size() * sizeof(uint32_t), parts.hullSources);
+    if (occupancy.IsBuilt()) {
+        occupancy.Serialize(data + header.gridOffset);
+    }
+
+    if (!scene->Attach(data, offset)) {
+        DEBUG_LOG_ERROR("[VisScene] Built scene failed validation");
+        return nullptr;
+    }
+    return scene;
+}
+
+std::shared_ptr<const VisScene> VisScene::FromData(std::vector<unsigned char> data) {
+    std::shared_ptr<VisScene> scene(new VisScene());
+    scene->storage = std::move(data);
+    if (!scene->Attach(scene->storage.data(), scene->storage.size())) {
+        DEBUG_LOG_ERROR("[VisScene] Scene data failed validation");
+        return nullptr;
+    }
+    return scene;
+}
+
+std::shared_ptr<const VisScene> VisScene::FromMapping(void* view, size_t size, void* handle) {
+    std::shared_ptr<VisScene> scene(new VisScene());
+    scene->mappedData = view;
+    scene->mappedSize = size;
+    scene->mappingHandle = handle;
+
+    if (!scene->Attach(static_cast<const unsigned char*>(view), size)) {
+        DEBUG_LOG_ERROR("[VisScene] Shared scene is invalid or not fully published");
+        return nullptr;
+    }
+    return scene;
+}
+
+// Point the scene at a blob after checking that every offset and index stays
+// inside it. Blobs can come from other processes, so nothing is trusted.
+bool VisScene::Attach(const unsigned char* data, size_t size) {
+    SceneHeader header = {};
+    const size_t versionTwoSize = offsetof(SceneHeader, sourceOffset);
+    if (size < versionTwoSize) {
+        return false;
+    }
+    std::memcpy(&header, data, versionTwoSize);
+    if (header.version == SCENE_VERSION) {
+        if (size < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(header));
+    } else if (header.version != SCENE_VERSION_NO_SOURCES) {
+        return false;
+    }
+    const bool hasSources = header.version == SCENE_VERSION;
+
+    if (header.magic != SCENE_MAGIC || header.totalSize > size) {
+        return false;
+    }
+    const uint64_t offsets[] = { header.meshOffset, header.nodeOffset, header.triangleOffset, header.hullOffset, header.planeOffset, header.sourceOffset };
+    for (uint64_t offset : offsets) {
+        if (offset % SCENE_ALIGNMENT) {
+            return false;
+        }
+    }
+
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t elementSize) {
+        return offset <= header.totalSize && count <= (header.totalSize - offset) / elementSize;
+    };
+    if (!fits(header.meshOffset, header.meshCount, sizeof(SceneMesh))
+        || !fits(header.nodeOffset, header.nodeCount, sizeof(BVHNode))
+        || !fits(header.triangleOffset, header.triangleCount, sizeof(TriangleCombined))
+        || !fits(header.hullOffset, header.hullCount, sizeof(SceneHull))
+        || !fits(header.planeOffset, header.planeCount, sizeof(HullPlane))
+        || (hasSources && !fits(header.sourceOffset, header.triangleCount + header.hullCount, sizeof(uint32_t)))
+        || !fits(header.gridOffset, header.gridSize, 1)) {
+        return false;
+    }
+
+    const SceneMesh* meshList = reinterpret_cast<const SceneMesh*>(data + header.meshOffset);
+    const BVHNode* nodeList = reinterpret_cast<const BVHNode*>(data + header.nodeOffset);
+    const SceneHull* hullList = reinterpret_cast<const SceneHull*>(data + header.hullOffset);
+
+    for (uint64_t i = 0; i < header.hullCount; ++i) {
+        if (hullList[i].planeCount == 0 || static_cast<uint64_t>(hullList[i].firstPlane) + hullList[i].planeCount > header.planeCount) {
+            return false;
+        }
+    }
+
+    // Bounded depth also rules out cycles and keeps traversal stacks fixed size
+    std::vector<std::pair<uint32_t, int>> pending;
+    for (uint64_t i = 0; i < header.meshCount; ++i) {
+        const SceneMesh& mesh = meshList[i];
+        uint64_t available;
+        if (mesh.primitiveType == SceneMesh::Triangles) {
+            available = header.triangleCount;
+        } else if (mesh.primitiveType == SceneMesh::Hulls) {
+            available = header.hullCount;
+        } else {
+            return false;
+        }
+        uint64_t meshEnd = static_cast<uint64_t>(mesh.firstPrimitive) + mesh.primitiveCount;
+        if (meshEnd > available) {
+            return false;
+        }
+        if (mesh.rootNode == SceneMesh::INVALID_NODE) {
+            continue;
+        }
+        if (mesh.rootNode >= header.nodeCount) {
+            return false;
+        }
+        pending.emplace_back(mesh.rootNode, 1);
+        while (!pending.empty()) {
+            auto [index, depth] = pending.back();
+            pending.pop_back();
+            if (depth > MAX_BVH_DEPTH) {
+                return false;
+            }
+            const BVHNode& node = nodeList[index];
+            if (node.IsLeaf()) {
+                if (node.firstPrimitive < mesh.firstPrimitive || static_cast<uint64_t>(node.firstPrimitive) + node.primitiveCount > meshEnd) {
+                    return false;
+                }
+            } else {
+                if (node.left >= header.nodeCount || node.right >= header.nodeCount) {
+                    return false;
+                }
+                pending.emplace_back(node.left, depth + 1);
+                pending.emplace_back(node.right, depth + 1);
+            }
+        }
+    }
+
+    if (header.gridSize > 0 && !grid.Attach(data + header.gridOffset, static_cast<size_t>(header.gridSize))) {
+        return false;
+    }
+
+    blob = data;
+    dataSize = static_cast<size_t>(header.totalSize);
+    meshCount = static_cast<size_t>(header.meshCount);
+    nodeCount = static_cast<size_t>(header.nodeCount);
+    triangleCount = static_cast<size_t>(header.triangleCount);
+    hullCount = static_cast<size_t>(header.hullCount);
+    planeCount = static_cast<size_t>(header.planeCount);
+    meshes = meshList;
+    nodes = nodeList;
+    triangles = reinterpret_cast<const TriangleCombined*>(data + header.triangleOffset);
+    hulls = hullList;
+    planes = reinterpret_cast<const HullPlane*>(data + header.planeOffset);
+    sources = hasSources ? reinterpret_cast<const uint32_t*>(data + header.sourceOffset) : nullptr;
+    return true;
+}
+
+std::vector<std::vector<TriangleCombined>> VisScene::ExtractMeshes() const {
+    std::vector<std::vector<TriangleCombined>> result;
+    for (size_t i = 0; i < meshCount; ++i) {
+        const SceneMesh& mesh = meshes[i];
+        if (mesh.primitiveType == SceneMesh::Triangles) {
+            result.emplace_back(triangles + mesh.firstPrimitive, triangles + mesh.firstPrimitive + mesh.primitiveCount);
+        }
+    }
+    return result;
+}
+
+uint32_t VisScene::SourceIndex(const SceneMesh& mesh, uint32_t primitive) const {
+    if (!sources) {
+        return primitive - mesh.firstPrimitive;
+    }
+    return mesh.primitiveType == SceneMesh::Hulls ? sources[triangleCount + primitive] : sources[primitive];
+}
+
+std::vector<uint32_t> VisScene::SourceIndices(uint32_t primitiveType) const {
+    std::vector<uint32_t> result(primitiveType == SceneMesh::Hulls ? hullCount : triangleCount, 0);
+    for (size_t i = 0; i < meshCount; ++i) {
+        const SceneMesh& mesh = meshes[i];
+        if (mesh.primitiveType != primitiveType) {
+            continue;
+        }
+        for (uint32_t p = mesh.firstPrimitive; p < mesh.firstPrimitive + mesh.primitiveCount; ++p) {
+            result[p] = SourceIndex(mesh, p);
+        }
+    }
+    return result;
+}
+
+std::vector<std::vector<HullCombined>> VisScene::ExtractHulls() const {
+    std::vector<std::vector<HullCombined>> result;
+    for (size_t i = 0; i < meshCount; ++i) {
+        const SceneMesh& mesh = meshes[i];
+        if (mesh.primitiveType != SceneMesh::Hulls) {
+            continue;
+        }
+        std::vector<HullCombined> hullSet(mesh.primitiveCount);
+        for (uint32_t j = 0; j < mesh.primitiveCount; ++j) {
+            const SceneHull& hull = hulls[mesh.firstPrimitive + j];
+            hullSet[j].bounds = hull.bounds;
+            hullSet[j].planes.assign(planes + hull.firstPlane, planes + hull.firstPlane + hull.planeCount);
+        }
+        result.push_back(std::move(hullSet));
+    }
+    return result;
+}
+
+// Clip the segment against every plane of the hull. Any remaining interval
+// means the segment passes through the solid.
+bool VisScene::IntersectHull(const SceneHull& hull, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance) const {
+    float tEnter = 0.0f;
+    float tExit = maxDistance;
+
+    for (uint32_t i = hull.firstPlane; i < hull.firstPlane + hull.planeCount; ++i) {
+        const HullPlane& plane = planes[i];
+        float denom = Vec3Helpers::Dot(plane.normal, rayDir);
+        float dist = Vec3Helpers::Dot(plane.normal, rayOrigin) - plane.offset;
+
+        if (denom == 0.0f) {
+            if (dist > 0.0f) {
+                return false;
+            }
+            continue;
+        }
+
+        float t = -dist / denom;
+        if (denom < 0.0f) {
+            tEnter = std::max(tEnter, t);
+        } else {
+            tExit = std::min(tExit, t);
+        }
+        if (tEnter >= tExit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Like IntersectHull, also reporting where the segment enters the hull and
+// the plane it enters through. A segment starting inside hits at distance 0.
+bool VisScene::HullEntry(const SceneHull& hull, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance,
+    float& distance, Vec3& normal) const {
+    float tEnter = 0.0f;
+    float tExit = maxDistance;
+    const HullPlane* entryPlane = nullptr;
+
+    for (uint32_t i = hull.firstPlane; i < hull.firstPlane + hull.planeCount; ++i) {
+        const HullPlane& plane = planes[i];
+        float denom = Vec3Helpers::Dot(plane.normal, rayDir);
+        float dist = Vec3Helpers::Dot(plane.normal, rayOrigin) - plane.offset;
+
+        if (denom == 0.0f) {
+            if (dist > 0.0f) {
+                return false;
+            }
+            continue;
+        }
+
+        float t = -dist / denom;
+        if (denom < 0.0f) {
+            if (t > tEnter) {
+                tEnter = t;
+                entryPlane = &plane;
+            }
+        } else {
+            tExit = std::min(tExit, t);
+        }
+        if (tEnter >= tExit) {
+            return false;
+        }
+    }
+
+    distance = tEnter;
+    normal = entryPlane ? entryPlane->normal : Vec3(-rayDir.x, -rayDir.y, -rayDir.z);
+    return true;
+}
+
+bool VisScene::IntersectBVH(const SceneMesh& mesh, const Vec3& rayOrigin, const Vec3& rayDir, float maxDistance) const {
+    uint32_t stack[MAX_BVH_DEPTH + 1];
+    int stackSize = 0;
+    stack[stackSize++] = mesh.rootNode;
+
+    while (stackSize > 0) {
+        const BVHNode& node = nodes[stack[--stackSize]];
+        if (!node.bounds.RayIntersects(rayOrigin, rayDir)) {
+            continue;
+        }
+
+        if (node.IsLeaf()) {
+            const uint32_t end = node.firstPrimitive + node.primitiveCount;
+            if (mesh.primitiveType == SceneMesh::Hulls) {
+                for (uint32_t i = node.firstPrimitive; i < end; ++i) {
+                    if (IntersectHull(hulls[i], rayOrigin, rayDir, maxDistance)) {
+                        return true;
+                    }
+                }
+            } else {
+                for (uint32_t i = node.firstPrimitive; i < end; ++i) {
+                    float t;
+                    if (RayIntersectsTriangle(rayOrigin, rayDir, triangles[i], t) && t < maxDistance) {
+                        return true;
+                    }
+                }
+            }
+        } else {
+            stack[stackSize++] = node.right;
+            stack[stackSize++] = node.left;
+        }
+    }
+    return false;
+}
+
+bool VisScene::IsVisible(const Vec3& point1, const Vec3& point2, uint32_t ignoreFlags) const {
+    Vec3 rayDir = Vec3Helpers::Subtract(point2, point1);
+    float distance = std::sqrt(Vec3Helpers::LengthSquared(rayDir));
+
+    if (distance < 0.001f) {
+        return true;
+    }
+
+    if (grid.IsBuilt() && ignoreFlags == 0) {
+        OccupancyGrid::Verdict verdict = grid.Classify(point1, point2);
+        if (verdict == OccupancyGrid::Verdict::Visible) {
+            return true;
+        }
+        if (verdict == OccupancyGrid::Verdict::Blocked) {
+            return false;
+        }
+    }
+
+    rayDir.x /= distance;
+    rayDir.y /= distance;
+    rayDir.z /= distance;
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        if ((meshes[i].flags & ignoreFlags) != 0) {
+            continue;
+        }
+        if (meshes[i].rootNode != SceneMesh::INVALID_NODE && IntersectBVH(meshes[i], point1, rayDir, distance)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool VisScene::Raycast(const Vec3& from, const Vec3& to, RayHit& hit, uint32_t ignoreFlags) const {
+    Vec3 dir = Vec3Helpers::Subtract(to, from);
+    const float length = std::sqrt(Vec3Helpers::LengthSquared(dir));
+    if (length < 0.001f) {
+        return false;
+    }
+
+    dir.x /= length;
+    dir.y /= length;
+    dir.z /= length;
+    const SampleRay ray = { from, dir, Vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z) };
+
+    struct RayEntry {
+        uint32_t node;
+        float distance;
+    };
+    RayEntry stack[MAX_BVH_DEPTH + 1];
+    float closest = length;
+    bool found = false;
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        const SceneMesh& mesh = meshes[i];
+        if (mesh.rootNode == SceneMesh::INVALID_NODE || (mesh.flags & ignoreFlags) != 0) {
+            continue;
+        }
+
+        float rootDistance;
+        if (!ClipToBounds(nodes[mesh.rootNode].bounds, ray, closest, rootDistance)) {
+            continue;
+        }
+
+        int stackSize = 0;
+        stack[stackSize++] = { mesh.rootNode, rootDistance };
+
+        while (stackSize > 0) {
+            const RayEntry entry = stack[--stackSize];
+            if (entry.distance > closest) {
+                continue;
+            }
+
+            const BVHNode& node = nodes[entry.node];
+            if (node.IsLeaf()) {
+                const uint32_t end = node.firstPrimitive + node.primitiveCount;
+                for (uint32_t p = node.firstPrimitive; p < end; ++p) {
+                    float t;
+                    Vec3 normal;
+                    if (mesh.primitiveType == SceneMesh::Hulls) {
+                        if (!HullEntry(hulls[p], from, dir, closest, t, normal)) {
+                            continue;
+                        }
+                    } else {
+                        const TriangleCombined& tri = triangles[p];
+                        if (!RayIntersectsTriangle(from, dir, tri, t) || t >= closest) {
+                            continue;
+                        }
+                        normal = Vec3Helpers::Cross(Vec3Helpers::Subtract(tri.v1, tri.v0), Vec3Helpers::Subtract(tri.v2, tri.v0));
+                        float scale = 1.0f / std::sqrt(Vec3Helpers::LengthSquared(normal));
+                        if (Vec3Helpers::Dot(normal, dir) > 0.0f) {
+                            scale = -scale;
+                        }
+                        normal = Vec3(normal.x * scale, normal.y * scale, normal.z * scale);
+                    }
+
+                    closest = t;
+                    found = true;
+                    hit.distance = t;
+                    hit.meshIndex = static_cast<uint32_t>(i);
+                    hit.primitiveIndex = SourceIndex(mesh, p);
+                    hit.normal = normal;
+                }
+                continue;
+            }
+
+            // Visit the nearer child first so the farther one is often culled
+            float leftDistance;
+            float rightDistance;
+            const bool left = ClipToBounds(nodes[node.left].bounds, ray, closest, leftDistance);
+            const bool right = ClipToBounds(nodes[node.right].bounds, ray, closest, rightDistance);
+            if (left && right) {
+                if (leftDistance <= rightDistance) {
+                    stack[stackSize++] = { node.right, rightDistance };
+                    stack[stackSize++] = { node.left, leftDistance };
+                } else {
+                    stack[stackSize++] = { node.left, leftDistance };
+                    stack[stackSize++] = { node.right, rightDistance };
+                }
+            } else if (left) {
+                stack[stackSize++] = { node.left, leftDistance };
+            } else if (right) {
+                stack[stackSize++] = { node.right, rightDistance };
+            }
+        }
+    }
+
+    return found;
+}
+
+uint32_t VisScene::TracePacket(const Vec3& origin, const Vec3* targets, size_t count, size_t maxBlocked) const {
+    count = std::min(count, MAX_PACKET_RAYS);
+
+    SampleRay rays[MAX_PACKET_RAYS];
+    float distances[MAX_PACKET_RAYS];
+    uint32_t active = 0;
+    uint32_t blocked = 0;
+    size_t blockedCount = 0;
+
+    for (size_t k = 0; k < count; ++k) {
+        Vec3 dir = Vec3Helpers::Subtract(targets[k], origin);
+        float distance = std::sqrt(Vec3Helpers::LengthSquared(dir));
+        if (distance < 0.001f) {
+            continue;
+        }
+
+        if (grid.IsBuilt()) {
+            OccupancyGrid::Verdict verdict = grid.Classify(origin, targets[k]);
+            if (verdict == OccupancyGrid::Verdict::Visible) {
+                continue;
+            }
+            if (verdict == OccupancyGrid::Verdict::Blocked) {
+                blocked |= 1u << k;
+                ++blockedCount;
+                continue;
+            }
+        }
+
+        dir.x /= distance;
+        dir.y /= distance;
+        dir.z /= distance;
+        rays[k].origin = origin;
+        rays[k].dir = dir;
+        rays[k].invDir = Vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+        distances[k] = distance;
+        active |= 1u << k;
+    }
+
+    if (blockedCount > maxBlocked || active == 0) {
+        return blocked;
+    }
+
+    // Hits closer than the target lie on the segments, so nodes outside the
+    // box around all active segments are skipped with one test for the packet
+    AABB packetBounds = { origin, origin };
+    for (size_t k = 0; k < count; ++k) {
+        if ((active >> k) & 1u) {
+            Extend(packetBounds, AABB{ targets[k], targets[k] });
+        }
+    }
+    const float padding = PACKET_BOUNDS_PADDING * (1.0f + std::max({ std::fabs(packetBounds.min.x), std::fabs(packetBounds.min.y),
+        std::fabs(packetBounds.min.z), std::fabs(packetBounds.max.x), std::fabs(packetBounds.max.y), std::fabs(packetBounds.max.z) }));
+    packetBounds.min = Vec3(packetBounds.min.x - padding, packetBounds.min.y - padding, packetBounds.min.z - padding);
+    packetBounds.max = Vec3(packetBounds.max.x + padding, packetBounds.max.y + padding, packetBounds.max.z + padding);
+
+    // Each stack entry carries the rays that entered its parent; rays blocked
+    // in the meantime are dropped when the entry is popped
+    struct PacketEntry {
+        uint32_t node;
+        uint32_t mask;
+    };
+    PacketEntry stack[MAX_BVH_DEPTH + 1];
+
+    for (size_t i = 0; i < meshCount && active != 0; ++i) {
+        const SceneMesh& mesh = meshes[i];
+        if (mesh.rootNode == SceneMesh::INVALID_NODE) {
+            continue;
+        }
+
+        int stackSize = 0;
+        stack[stackSize++] = { mesh.rootNode, active };
+
+        while (stackSize > 0) {
+            const PacketEntry entry = stack[--stackSize];
+            const uint32_t mask = entry.mask & active;
+            if (mask == 0) {
+                continue;
+            }
+
+            const BVHNode& node = nodes[entry.node];
+            if (!Overlaps(node.bounds, packetBounds)) {
+                continue;
+            }
+
+            uint32_t entered = 0;
+            for (size_t k = 0; k < count; ++k) {
+                if (((mask >> k) & 1u) != 0 && SampleEnters(node.bounds, rays[k])) {
+                    entered |= 1u << k;
+                }
+            }
+            if (entered == 0) {
+                continue;
+            }
+
+            if (!node.IsLeaf()) {
+                stack[stackSize++] = { node.right, entered };
+                stack[stackSize++] = { node.left, entered };
+                continue;
+            }
+
+            const uint32_t end = node.firstPrimitive + node.primitiveCount;
+            for (uint32_t p = node.firstPrimitive; p < end && (entered & active) != 0; ++p) {
+                for (size_t k = 0; k < count; ++k) {
+                    if (((entered & active) >> k & 1u) == 0) {
+                        continue;
+                    }
+
+                    bool hit;
+                    if (mesh.primitiveType == SceneMesh::Hulls) {
+                        hit = IntersectHull(hulls[p], origin, rays[k].dir, distances[k]);
+                    } else {
+                        float t;
+                        hit = RayIntersectsTriangle(origin, rays[k].dir, triangles[p], t) && t < distances[k];
+                    }
+
+                    if (hit) {
+                        active &= ~(1u << k);
+                        blocked |= 1u << k;
+                        if (++blockedCount > maxBlocked) {
+                            return blocked;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return blocked;
+}
+
+std::shared_ptr<const VisScene> VisScene::WithMeshFlags(const std::vector<uint32_t>& flags,
+    const VisSceneOptions& options) const {
+    if (flags.size() != meshCount) {
+        DEBUG_LOG_ERROR("[VisScene] Got flags for " << flags.size() << " meshes, scene has " << meshCount);
+        return nullptr;
+    }
+
+    Parts parts = CopyParts();
+    for (size_t i = 0; i < meshCount; ++i) {
+        parts.meshes[i].flags = flags[i];
+    }
+    return FromParts(parts, options);
+}
+
+VisScene::Parts VisScene::CopyParts() const {
+    Parts parts;
+    parts.meshes.assign(meshes, meshes + meshCount);
+    parts.nodes.assign(nodes, nodes + nodeCount);
+    parts.triangles.assign(triangles, triangles + triangleCount);
+    parts.hulls.assign(hulls, hulls + hullCount);
+    parts.planes.assign(planes, planes + planeCount);
+    parts.triangleSources = SourceIndices(SceneMesh::Triangles);
+    parts.hullSources = SourceIndices(SceneMesh::Hulls);
+    return parts;
+}
+
+std::shared_ptr<const VisScene> VisScene::WithOptions(const VisSceneOptions& options) const {
+    return FromParts(CopyParts(), options);
+}
+
+std::shared_ptr<const VisScene> VisScene::OptimizeForQueries(const std::vector<QuerySegment>& samples,
+    const VisSceneOptions& options) const {
+    // Samples the grid answers on its own never reach the BVH
+    std::vector<SampleRay> rays;
+    rays.reserve(samples.size());
+    for (const QuerySegment& sample : samples) {
+        Vec3 dir = Vec3Helpers::Subtract(sample.to, sample.from);
+        float distance = std::sqrt(Vec3Helpers::LengthSquared(dir));
+        if (distance < 0.001f) {
+            continue;
+        }
+        if (grid.IsBuilt() && grid.Classify(sample.from, sample.to) != OccupancyGrid::Verdict::Unknown) {
+            continue;
+        }
+        SampleRay ray;
+        ray.origin = sample.from;
+        ray.dir = Vec3(dir.x / distance, dir.y / distance, dir.z / distance);
+        ray.invDir = Vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+        rays.push_back(ray);
+    }
+
+    if (rays.empty()) {
+        DEBUG_LOG_WARNING("[VisScene] No query samples reach the BVH, nothing to optimize");
+        return nullptr;
+    }
+
+    Parts parts = CopyParts();
+    parts.nodes.clear();
+
+    const std::vector<BVHNode> original(nodes, nodes + nodeCount);
+    std::vector<BVHNode> rotated = original;
+    size_t visitsBefore = 0;
+    size_t visitsAfter = 0;
+    size_t rotations = 0;
+
+    for (size_t i = 0; i < meshCount; ++i) {
+        SceneMesh& mesh = parts.meshes[i];
+        if (mesh.rootNode == SceneMesh::INVALID_NODE) {
+            continue;
+        }
+
+        const size_t before = CountNodeVisits(original, mesh.rootNode, rays);
+        RotationOptimizer optimizer(rotated, rays);
+        size_t meshRotations = optimizer.Optimize(mesh.rootNode);
+
+        size_t firstNode = parts.nodes.size();
+        uint32_t root = RelayoutNode(rotated, mesh.rootNode, parts.nodes, 1);
+        size_t after = root == SceneMesh::INVALID_NODE ? before : CountNodeVisits(parts.nodes, root, rays);
+        if (root == SceneMesh::INVALID_NODE || after > before) {
+            // Too deep or no better on the samples: keep the original tree
+            parts.nodes.resize(firstNode);
+            root = RelayoutNode(original, mesh.rootNode, parts.nodes, 1);
+            after = before;
+            meshRotations = 0;
+        }
+
+        mesh.rootNode = root;
+        mesh.nodeCount = static_cast<uint32_t>(parts.nodes.size() - firstNode);
+        visitsBefore += before;
+        visitsAfter += after;
+        rotations += meshRotations;
+    }
+
+    DEBUG_LOG_INFO("[VisScene] Optimized BVH for " << rays.size() << " query samples: " << rotations
+        << " rotations, node tests per query " << static_cast<double>(visitsBefore) / rays.size()
+        << " -> " << static_cast<double>(visitsAfter) / rays.size());
+
+    return FromParts(parts, options);
+}
+
+bool VisScene::SaveBVHCache(const std::string& cachePath) const {
+    try {
+        std::ofstream out(cachePath, std::ios::binary);
+        if (!out) {
+            DEBUG_LOG_ERROR("[VisScene] Failed to create BVH cache file: " << cachePath);
+            return false;
+        }
+
+        out.write(reinterpret_cast<const char*>(&CACHE_VERSION), sizeof(uint32_t));
+
+        size_t numMeshes = meshCount;
+        out.write(reinterpret_cast<const char*>(&numMeshes), sizeof(size_t));
+
+        for (size_t i = 0; i < meshCount; ++i) {
+            uint32_t primitiveType = meshes[i].primitiveType;
+            uint32_t flags = meshes[i].flags;
+            size_t numPrims = meshes[i].primitiveCount;
+            out.write(reinterpret_cast<const char*>(&primitiveType), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&flags), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&numPrims), sizeof(size_t));
+        }
+
+        const std::vector<uint32_t> triangleSources = SourceIndices(SceneMesh::Triangles);
+        const std::vector<uint32_t> hullSources = SourceIndices(SceneMesh::Hulls);
+        const CacheSource source = { nodes, triangles, hulls, planes, triangleSources.data(), hullSources.data() };
+        for (size_t i = 0; i < meshCount; ++i) {
+            SerializeBVHNode(out, source, meshes[i].primitiveType, meshes[i].rootNode);
+        }
+
+        out.close();
+        return static_cast<bool>(out);
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[VisScene] Exception saving BVH cache: " << e.what());
+        return false;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[VisScene] Unknown exception saving BVH cache");
+        return false;
+    }
+}
+
+std::shared_ptr<const VisScene> VisScene::LoadBVHCache(const std::string& cachePath, const VisSceneOptions& options) {
+    try {
+        std::ifstream in(cachePath, std::ios::binary);
+        if (!in) {
+            DEBUG_LOG_ERROR("[VisScene] Failed to open BVH cache file: " << cachePath);
+            return nullptr;
+        }
+
+        uint32_t version = 0;
+        in.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+        if (version != CACHE_VERSION && version != CACHE_VERSION_FLAGS && version != CACHE_VERSION_HULLS
+            && version != CACHE_VERSION_TRIANGLES) {
+            DEBUG_LOG_WARNING("[VisScene] BVH cache version mismatch (expected " << CACHE_VERSION << ", got " << version << ")");
+            return nullptr;
+        }
+
+        size_t numMeshes = 0;
+        in.read(reinterpret_cast<char*>(&numMeshes), sizeof(size_t));
+
+        if (!in || numMeshes == 0 || numMeshes >= SceneMesh::INVALID_NODE) {
+            DEBUG_LOG_WARNING("[VisScene] BVH cache has no usable meshes");
+            return nullptr;
+        }
+
+        std::vector<uint32_t> primitiveTypes(numMeshes, SceneMesh::Triangles);
+        std::vector<uint32_t> meshFlags(numMeshes, 0);
+        std::vector<size_t> primitiveCounts(numMeshes);
+        for (size_t i = 0; i < numMeshes; ++i) {
+            if (version != CACHE_VERSION_TRIANGLES) {
+                in.read(reinterpret_cast<char*>(&primitiveTypes[i]), sizeof(uint32_t));
+                if (primitiveTypes[i] != SceneMesh::Triangles && primitiveTypes[i] != SceneMesh::Hulls) {
+                    DEBUG_LOG_ERROR("[VisScene] BVH cache mesh " << i << " has unknown primitive type " << primitiveTypes[i]);
+                    return nullptr;
+                }
+            }
+            if (version >= CACHE_VERSION_FLAGS) {
+                in.read(reinterpret_cast<char*>(&meshFlags[i]), sizeof(uint32_t));
+            }
+            in.read(reinterpret_cast<char*>(&primitiveCounts[i]), sizeof(size_t));
+        }
+
+        Parts parts;
+        bool ok = static_cast<bool>(in);
+
+        for (size_t i = 0; i < numMeshes && ok; ++i) {
+            const uint32_t primitiveType = primitiveTypes[i];
+            auto primitiveTotal = [&]() {
+                return primitiveType == SceneMesh::Hulls ? parts.hulls.size() : parts.triangles.size();
+            };
+
+            SceneMesh record;
+            size_t firstNode = parts.nodes.size();
+            record.primitiveType = primitiveType;
+            record.flags = meshFlags[i];
+            record.firstPrimitive = static_cast<uint32_t>(primitiveTotal());
+            std::vector<uint32_t>& sources = primitiveType == SceneMesh::Hulls ? parts.hullSources : parts.triangleSources;
+            record.rootNode = DeserializeBVHNode(in, primitiveType, parts.nodes, parts.triangles, parts.hulls, parts.planes,
+                version == CACHE_VERSION ? &sources : nullptr, 1, ok);
+            record.nodeCount = static_cast<uint32_t>(parts.nodes.size() - firstNode);
+            record.primitiveCount = static_cast<uint32_t>(primitiveTotal() - record.firstPrimitive);
+
+            // Older caches only know the scene order
+            while (sources.size() < primitiveTotal()) {
+                sources.push_back(static_cast<uint32_t>(sources.size() - record.firstPrimitive));
+            }
+
+            if (ok && record.primitiveCount != primitiveCounts[i]) {
+                DEBUG_LOG_ERROR("[VisScene] BVH tree " << i << " holds " << record.primitiveCount
+                    << " primitives, header says " << primitiveCounts[i]);
+                ok = false;
+            }
+            if (!ok) {
+                DEBUG_LOG_ERROR("[VisScene] Failed to deserialize BVH tree " << i);
+                break;
+            }
+            parts.meshes.push_back(record);
+        }
+
+        if (!ok) {
+            return nullptr;
+        }
+
+        return FromParts(parts, options);
+    } catch (const std::exception& e) {
+        DEBUG_LOG_ERROR("[VisScene] Exception loading BVH cache: " << e.what());
+        return nullptr;
+    } catch (...) {
+        DEBUG_LOG_ERROR("[VisScene] Unknown exception loading BVH cache");
+        return nullptr;
+    }
+}
+
+std::shared_ptr<const VisScene> VisScene::PublishShared(const std::string& name) const {
+    const std::string objectName = SharedObjectName(name);
+
+#ifdef _WIN32
+    const uint64_t size64 = dataSize;
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+        static_cast<DWORD>(size64 >> 32), static_cast<DWORD>(size64 & 0xFFFFFFFFu), objectName.c_str());
+    if (!mapping) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to create shared scene " << objectName);
+        return nullptr;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+        DEBUG_LOG_ERROR("[VisScene] Shared scene " << objectName << " already exists");
+        CloseHandle(mapping);
+        return nullptr;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, dataSize);
+    if (!view) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to map shared scene " << objectName);
+        CloseHandle(mapping);
+        return nullptr;
+    }
+    CopyToSegment(view, blob, dataSize);
+    UnmapViewOfFile(view);
+
+    // The segment lives as long as a handle to it is open, so the returned
+    // scene keeps the publisher's handle
+    void* readView = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, dataSize);
+    if (!readView) {
+        CloseHandle(mapping);
+        return nullptr;
+    }
+    auto scene = FromMapping(readView, dataSize, mapping);
+#else
+    int fd = shm_open(objectName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to create shared scene " << objectName << " (already exists?)");
+        return nullptr;
+    }
+    if (ftruncate(fd, static_cast<off_t>(dataSize)) != 0) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to size shared scene " << objectName);
+        close(fd);
+        shm_unlink(objectName.c_str());
+        return nullptr;
+    }
+
+    void* view = mmap(nullptr, dataSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to map shared scene " << objectName);
+        shm_unlink(objectName.c_str());
+        return nullptr;
+    }
+    CopyToSegment(view, blob, dataSize);
+    mprotect(view, dataSize, PROT_READ);
+    auto scene = FromMapping(view, dataSize, nullptr);
+#endif
+
+    if (scene) {
+        DEBUG_LOG_INFO("[VisScene] Published shared scene " << objectName << " (" << dataSize << " bytes)");
+    }
+    return scene;
+}
+
+std::shared_ptr<const VisScene> VisScene::OpenShared(const std::string& name) {
+    const std::string objectName = SharedObjectName(name);
+
+#ifdef _WIN32
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, objectName.c_str());
+    if (!mapping) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to open shared scene " << objectName);
+        return nullptr;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to map shared scene " << objectName);
+        CloseHandle(mapping);
+        return nullptr;
+    }
+    MEMORY_BASIC_INFORMATION info;
+    size_t size = VirtualQuery(view, &info, sizeof(info)) ? static_cast<size_t>(info.RegionSize) : 0;
+    return FromMapping(view, size, mapping);
+#else
+    int fd = shm_open(objectName.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to open shared scene " << objectName);
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        DEBUG_LOG_ERROR("[VisScene] Shared scene " << objectName << " is empty");
+        close(fd);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(info.st_size);
+    void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        DEBUG_LOG_ERROR("[VisScene] Failed to map shared scene " << objectName);
+        return nullptr;
+    }
+    return FromMapping(view, size, nullptr);
+#endif
+}
+
+bool VisScene::RemoveShared(const std::string& name) {
+#ifdef _WIN32
+    // Windows drops the segment once the last handle to it is closed
+    (void)name;
+    return true;
+#else
+    return shm_unlink(SharedObjectName(name).c_str()) == 0;
+#endif
+}
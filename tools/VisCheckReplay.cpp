@@ -0,0 +1,238 @@
+// Replays a query trace recorded with VisCheck::StartTrace against a map and
+// reports throughput, latency percentiles and any results that differ from
+// the trace.
+//
+// Usage: VisCheckReplay <map.opt|map.bvh|map.vtil> <trace.vtrc> [options]
+//   --threads N        replay on N threads (default 1)
+//   --passes N         replay the trace N times (default 1)
+//   --grid CELLSIZE    enable the occupancy grid before loading the map
+//   --occluder FILE    load a conservative occluder (.opt)
+//   --no-verify        do not compare results with the trace
+//
+// Exit code 0 when every result matches, 1 on mismatches, 2 on errors.
+
+#include "VisCheck.h"
+#include "QueryTrace.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <system_error>
+
+namespace {
+    // Queries claimed by a replay thread at a time
+    const size_t REPLAY_BLOCK = 256;
+
+    struct ReplayOptions {
+        std::string mapPath;
+        std::string tracePath;
+        std::string occluderPath;
+        unsigned threads = 1;
+        unsigned passes = 1;
+        float gridCellSize = 0.0f;
+        bool verify = true;
+    };
+
+    void PrintUsage() {
+        std::cout << "Usage: VisCheckReplay <map.opt|map.bvh|map.vtil> <trace.vtrc> [options]\n"
+            << "  --threads N        replay on N threads (default 1)\n"
+            << "  --passes N         replay the trace N times (default 1)\n"
+            << "  --grid CELLSIZE    enable the occupancy grid before loading the map\n"
+            << "  --occluder FILE    load a conservative occluder (.opt)\n"
+            << "  --no-verify        do not compare results with the trace" << std::endl;
+    }
+
+    bool ParseArguments(int argc, char* argv[], ReplayOptions& options) {
+        std::vector<std::string> positional;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--threads" && hasValue) {
+                options.threads = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--passes" && hasValue) {
+                options.passes = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+            } else if (arg == "--grid" && hasValue) {
+                options.gridCellSize = static_cast<float>(std::atof(argv[++i]));
+            } else if (arg == "--occluder" && hasValue) {
+                options.occluderPath = argv[++i];
+            } else if (arg == "--no-verify") {
+                options.verify = false;
+            } else if (arg.compare(0, 2, "--") == 0) {
+                std::cout << "Unknown option: " << arg << std::endl;
+                return false;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() != 2) {
+            return false;
+        }
+        options.mapPath = positional[0];
+        options.tracePath = positional[1];
+        return true;
+    }
+
+    bool EndsWith(const std::string& text, const std::string& suffix) {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    bool LoadMap(VisCheck& visCheck, const ReplayOptions& options) {
+        if (options.gridCellSize > 0.0f) {
+            visCheck.EnableOccupancyGrid(options.gridCellSize);
+        }
+
+        bool loaded;
+        if (EndsWith(options.mapPath, ".opt")) {
+            loaded = visCheck.LoadFromOptFile(options.mapPath);
+        } else if (EndsWith(options.mapPath, ".vtil")) {
+            loaded = visCheck.LoadTiledFile(options.mapPath);
+        } else {
+            loaded = visCheck.LoadBVHFromFile(options.mapPath);
+        }
+        if (!loaded) {
+            return false;
+        }
+
+        return options.occluderPath.empty() || visCheck.LoadOccluderFile(options.occluderPath);
+    }
+
+    // Nearest-rank percentile of sorted latencies, in microseconds
+    double Percentile(const std::vector<uint32_t>& sorted, double fraction) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        size_t rank = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+        return sorted[rank] / 1000.0;
+    }
+
+    void PrintLatencies(const char* label, std::vector<uint32_t>& latencies) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << label << " (us): p50 " << Percentile(latencies, 0.5)
+            << "  p90 " << Percentile(latencies, 0.9)
+            << "  p99 " << Percentile(latencies, 0.99)
+            << "  p99.9 " << Percentile(latencies, 0.999)
+            << "  max " << Percentile(latencies, 1.0) << std::endl;
+    }
+
+    // Replays every record once. Threads claim blocks of records in trace
+    // order and each record's result and latency have a single writer.
+    double ReplayPass(const VisCheck& source, const std::vector<TraceRecord>& records, unsigned threadCount,
+        std::vector<uint8_t>& results, uint32_t* latencies) {
+        std::atomic<size_t> nextRecord(0);
+
+        auto worker = [&]() {
+            VisCheck handle(source.GetScene());
+            if (source.GetTiledScene()) {
+                handle.SetTiledScene(source.GetTiledScene());
+            }
+            handle.SetOccluder(source.GetOccluder());
+
+            for (;;) {
+                size_t begin = nextRecord.fetch_add(REPLAY_BLOCK);
+                if (begin >= records.size()) {
+                    break;
+                }
+                size_t end = std::min(records.size(), begin + REPLAY_BLOCK);
+                for (size_t i = begin; i < end; ++i) {
+                    auto start = std::chrono::steady_clock::now();
+                    bool visible = handle.IsVisible(records[i].from, records[i].to);
+                    auto elapsed = std::chrono::steady_clock::now() - start;
+                    results[i] = visible ? 1 : 0;
+                    latencies[i] = static_cast<uint32_t>(std::min<long long>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), UINT32_MAX));
+                }
+            }
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        try {
+            for (unsigned t = 1; t < threadCount; ++t) {
+                threads.emplace_back(worker);
+            }
+        } catch (const std::system_error& e) {
+            std::cout << "Started " << threads.size() + 1 << " of " << threadCount << " threads: " << e.what() << std::endl;
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    ReplayOptions options;
+    if (!ParseArguments(argc, argv, options)) {
+        PrintUsage();
+        return 2;
+    }
+
+    std::vector<TraceRecord> records;
+    bool hasLatency = false;
+    if (!QueryTrace::Load(options.tracePath, records, &hasLatency)) {
+        return 2;
+    }
+    if (records.empty()) {
+        std::cout << "Trace is empty: " << options.tracePath << std::endl;
+        return 2;
+    }
+
+    VisCheck visCheck;
+    if (!LoadMap(visCheck, options)) {
+        std::cout << "Failed to load map: " << options.mapPath << std::endl;
+        return 2;
+    }
+
+    std::cout << "Replaying " << records.size() << " queries on " << options.threads << " thread(s), "
+        << options.passes << " pass(es)" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+
+    std::vector<uint8_t> results(records.size());
+    std::vector<uint32_t> latencies(records.size() * options.passes);
+    size_t totalMismatches = 0;
+
+    for (unsigned pass = 0; pass < options.passes; ++pass) {
+        double seconds = ReplayPass(visCheck, records, options.threads, results, latencies.data() + pass * records.size());
+
+        std::cout << "Pass " << (pass + 1) << ": " << seconds * 1000.0 << " ms, "
+            << static_cast<uint64_t>(records.size() / seconds) << " queries/s";
+
+        if (options.verify) {
+            size_t mismatches = 0;
+            for (size_t i = 0; i < records.size(); ++i) {
+                if (results[i] != (records[i].visible ? 1 : 0)) {
+                    if (totalMismatches + mismatches < 10) {
+                        std::cout << "\n  query " << i << " (" << records[i].from.x << ", " << records[i].from.y << ", " << records[i].from.z
+                            << ") -> (" << records[i].to.x << ", " << records[i].to.y << ", " << records[i].to.z << "): trace "
+                            << (records[i].visible ? "VISIBLE" : "BLOCKED") << ", replay " << (results[i] ? "VISIBLE" : "BLOCKED");
+                    }
+                    ++mismatches;
+                }
+            }
+            std::cout << (mismatches ? "\n  " : ", ") << mismatches << " mismatches";
+            totalMismatches += mismatches;
+        }
+        std::cout << std::endl;
+    }
+
+    PrintLatencies("Replay latency", latencies);
+    if (hasLatency) {
+        std::vector<uint32_t> recorded(records.size());
+        for (size_t i = 0; i < records.size(); ++i) {
+            recorded[i] = records[i].latencyNanoseconds;
+        }
+        PrintLatencies("Recorded latency", recorded);
+    }
+
+    if (options.verify) {
+        std::cout << (totalMismatches == 0 ? "All results match the trace" : "Results differ from the trace") << std::endl;
+    }
+    return totalMismatches == 0 ? 0 : 1;
+}